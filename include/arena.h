@@ -0,0 +1,63 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "image.h"
+
+// Bump allocator for the scratch buffers of one conversion (IDAT joins,
+// inflated scanlines, filtered rows). Allocations are never freed
+// individually; reset() drops them all at once but keeps the memory, so the
+// next conversion reuses warm pages instead of asking the system allocator.
+class ScratchArena {
+public:
+  static const size_t kAlignment = 64;
+
+  ScratchArena() = default;
+  ~ScratchArena();
+  ScratchArena(const ScratchArena&) = delete;
+  ScratchArena& operator=(const ScratchArena&) = delete;
+
+  // Returns nullptr only when the system is out of memory.
+  void* allocate(size_t size, size_t alignment = kAlignment);
+
+  template <typename T>
+  T* allocate_array(size_t count) { return static_cast<T*>(allocate(count * sizeof(T))); }
+
+  // Pixel storage laid out like ImageBuffer (64-byte aligned, padded rows).
+  // Returns an empty view on allocation failure.
+  ImageView allocate_image(uint32_t width, uint32_t height, PixelLayout layout);
+
+  // Releases every allocation. When the last run spilled into several blocks
+  // they are merged into one, so a repeat of the same work needs a single block.
+  void reset();
+
+  // Frees the memory itself, e.g. after an unusually large image.
+  void release();
+
+  size_t capacity() const;
+
+private:
+  struct Block {
+    uint8_t* data;
+    size_t size;
+    size_t used;
+  };
+  std::vector<Block> blocks_;
+};
+
+// Checks a ScratchArena out of a process-wide pool for the lifetime of one
+// conversion step, resetting and returning it afterwards. Concurrent encodes
+// each get their own arena, and arenas survive across files in a batch.
+class ScratchLease {
+public:
+  ScratchLease();
+  ~ScratchLease();
+  ScratchLease(const ScratchLease&) = delete;
+  ScratchLease& operator=(const ScratchLease&) = delete;
+
+  ScratchArena& arena() { return *arena_; }
+  ScratchArena* operator->() { return arena_; }
+
+private:
+  ScratchArena* arena_;
+};
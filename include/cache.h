@@ -0,0 +1,53 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "png.h"
+
+// Cache of deflated PNG payloads keyed by a hash of the source pixels.
+// Entries live in memory for the lifetime of the cache and, when a directory
+// is given, are also persisted there so later runs can skip unchanged sizes.
+// Entry files record their key and are only used when it matches.
+class PayloadCache {
+public:
+  explicit PayloadCache(std::string directory = "");
+
+  // Returns the encoded PNG for img, running encode_png only on a miss.
+  PNGPayload get_or_encode(const ImageView& img, const PNGOptions& options = PNGOptions());
+  PNGPayload get_or_encode(const PNGImage& img, const PNGOptions& options = PNGOptions());
+
+  // Bounds the in-memory entries (0, the default, is unbounded). Long-running
+  // processes set this; when full the memory side starts over, while entries
+  // on disk stay available.
+  void set_memory_limit(size_t bytes) { memory_limit_ = bytes; }
+
+  size_t hits() const { return hits_; }
+  size_t misses() const { return misses_; }
+
+private:
+  struct Key {
+    uint64_t hash;
+    uint32_t width;
+    uint32_t height;
+    uint32_t variant; // png_options_key of the encoder settings
+    bool operator==(const Key& o) const { return hash == o.hash && width == o.width && height == o.height && variant == o.variant; }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& k) const { return static_cast<size_t>(k.hash); }
+  };
+
+  std::string path_for(const Key& key) const;
+  PNGPayload load_from_disk(const Key& key) const;
+  void store_to_disk(const Key& key, const std::vector<uint8_t>& data) const;
+
+  std::string directory_;
+  std::mutex mutex_;
+  std::unordered_map<Key, PNGPayload, KeyHash> entries_;
+  size_t memory_limit_ = 0;
+  size_t memory_used_ = 0;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+};
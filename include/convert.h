@@ -0,0 +1,58 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+#include "icns.h"
+#include "targets.h"
+
+// One source-to-.icns conversion, as described by the command line. The CLI
+// and the conversion server share it, so both accept the same options. An
+// input or output of "-" means standard input or output.
+struct ConvertJob {
+  std::string input;
+  std::string output;
+  // output plus every --output path; one decode and resize feeds them all
+  std::vector<OutputTarget> targets;
+  // Encoded source bytes sent by a client; when set, input only names them
+  std::vector<uint8_t> input_data;
+  std::string cache_dir;
+  // Sizes to re-encode and splice into an existing output (--update)
+  std::vector<uint32_t> update_sizes;
+  // Dedicated artwork for particular sizes (--size 16=small.png); sizes
+  // without one use the nearest larger of all the sources
+  std::vector<std::pair<uint32_t, std::string>> size_sources;
+  // Embed source PNGs that already have a target's exact size instead of
+  // re-encoding them (--passthrough), optionally without ancillary chunks
+  bool passthrough = false;
+  bool strip_chunks = false;
+  // Cursor hotspot in source pixels (--hotspot), scaled to each .cur size
+  uint32_t hotspot_x = 0;
+  uint32_t hotspot_y = 0;
+  IcnsOptions options;
+  // Keep running and re-convert whenever the input changes (see watch.h)
+  bool watch = false;
+  uint32_t debounce_ms = 250;
+};
+
+// Parses "input output [options...]" into job. Problems are reported on
+// stderr; returns false on the first one.
+bool parse_convert_args(const std::vector<std::string>& args, ConvertJob& job);
+
+// Maps the file and decodes it with the registered decoder that recognises its
+// leading bytes (see decoder.h); "-" reads standard input.
+bool load_image(const char* filename, PNGImage& out);
+// Reads all of standard input (in binary mode) into out.
+bool read_stdin(std::vector<uint8_t>& out);
+
+// Loads the source, resizes it to every size and writes or updates the .icns.
+// cache overrides job.options.cache when not null, so a long-running process
+// can share one across jobs. Sources are only decoded for sizes that need
+// their pixels.
+bool run_conversion(const ConvertJob& job, PayloadCache* cache = nullptr);
+// The same with the main source's encoded bytes already in memory; job.input
+// only names them.
+bool convert_data(const ConvertJob& job, const uint8_t* data, size_t size, PayloadCache* cache = nullptr);
+
+// "ICNS file created successfully: ..." for each target, one per line.
+std::string describe_result(const ConvertJob& job);
@@ -1,7 +1,10 @@
+#pragma once
+#include <cstddef>
 #include <cstdint>
 
-static uint32_t crc_table[256];
-
+// CRC-32 as used by PNG chunks, computed eight bytes per step (slicing-by-8).
 uint32_t crc(const uint8_t* buf, size_t len);
+// Continues a running CRC; start from 0xffffffff and invert the final value.
 uint32_t update_crc(uint32_t crc, const uint8_t* buf, size_t len);
-void make_crc_table();
\ No newline at end of file
+// Builds the lookup tables up front (they are otherwise built on first use).
+void make_crc_table();
@@ -0,0 +1,24 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// Conversion server on a local (Unix domain) socket. Workers, pooled zlib
+// streams, scratch arenas and the payload cache stay warm between requests,
+// so a build that converts many icons pays process start-up only once.
+//
+// Wire format, all integers big-endian u32:
+//   request:  "ICV1", kind (0 convert, 1 stop), argument count, then each
+//             argument as length + bytes, then input length + bytes (0 when
+//             the server should read the input path itself)
+//   response: status (0 success), message length + bytes
+
+// Serves until a stop request arrives; returns the process exit code.
+int run_server(const std::string& socket_path, const std::string& cache_dir, unsigned workers);
+
+// Sends "input output [options...]" to the server at socket_path. Paths are
+// made absolute first; with send_input the source bytes travel over the
+// socket instead. Returns the process exit code.
+int run_client(const std::string& socket_path, const std::vector<std::string>& args, bool send_input);
+
+// Asks the server to finish queued requests and exit.
+int stop_server(const std::string& socket_path);
@@ -0,0 +1,23 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "png.h"
+
+// One source image format. sniff() looks only at the leading bytes; decode()
+// gets the whole encoded image, which is usually a memory-mapped file.
+struct ImageDecoder {
+  const char* name;
+  bool (*sniff)(const uint8_t* data, size_t size);
+  bool (*decode)(const uint8_t* data, size_t size, const std::string& source, PNGImage& out);
+};
+
+// Adds a format. Decoders are tried in registration order after the built-in
+// PNG and JPEG ones; register them before any conversion starts.
+void register_decoder(const ImageDecoder& decoder);
+
+// The decoder whose sniff() accepts data, or nullptr.
+const ImageDecoder* find_decoder(const uint8_t* data, size_t size);
+
+// Sniffs and decodes data; source only names it in messages.
+bool decode_image(const uint8_t* data, size_t size, const std::string& source, PNGImage& out);
@@ -0,0 +1,15 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// In-tree deflate encoder tuned for filtered PNG scanlines: hash chains keyed
+// on 4-byte pixels, direct probes of the previous pixel and the row above, a
+// run fast path for flat regions, and a per-block choice between fixed,
+// dynamic and stored coding (small icons usually end up with the fixed code).
+//
+// Writes a complete zlib stream (header, deflate data, Adler-32) into dst and
+// returns its size, or 0 when dst_capacity is too small. compressBound(len)
+// is always enough. pixel_bytes and row_bytes give the distances to the
+// previous pixel and the scanline above; 0 disables that probe.
+size_t builtin_deflate(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_capacity,
+  size_t pixel_bytes = 4, size_t row_bytes = 0);
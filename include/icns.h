@@ -1,5 +1,113 @@
+#pragma once
+#include <map>
 #include <vector>
 #include <string>
 #include "png.h"
+#include "quantize.h"
+#include "cache.h"
+#include "mapped_file.h"
+#include "output.h"
 
-bool write_icns(const char* filename, const std::vector<PNGImage>& images);
\ No newline at end of file
+class PayloadSet;
+
+struct IcnsOptions {
+  // Reuses encoded PNG payloads for unchanged pixels when set
+  PayloadCache* cache = nullptr;
+  // Only these pixel sizes are written, in every container (all when empty)
+  std::vector<uint32_t> sizes;
+  // Only these ICNS element types are written (all when empty); see select_icns_types
+  std::vector<std::string> types;
+  // Sizes (16, 32, 48, 128) written as legacy RLE + 8-bit mask elements
+  // (is32/s8mk, il32/l8mk, ih32/h8mk, it32/t8mk) instead of a PNG entry
+  std::vector<uint32_t> rle_sizes;
+  // Temp-file-and-rename, fsync and direct I/O settings for the output file
+  OutputOptions output;
+  // Encoder settings for PNG elements
+  PNGOptions png;
+  // Lossy palette reduction applied to the small PNG elements before encoding
+  QuantizeOptions quantize;
+  // Cursor hotspot for .cur outputs, as a fraction of the image size
+  float hotspot_x = 0;
+  float hotspot_y = 0;
+  // Encoded PNGs embedded unchanged for their pixel size instead of encoding
+  // the resized image (see --passthrough)
+  std::map<uint32_t, PNGPayload> png_passthrough;
+  // PNG payloads shared with the other containers written from the same images
+  // (see targets.h); encoded here when null
+  PayloadSet* payloads = nullptr;
+};
+
+// Pixel sizes write_icns needs images for with these options.
+std::vector<uint32_t> icns_sizes(const IcnsOptions& options = IcnsOptions());
+
+// True when the file stores size as something other than a PNG payload
+// (legacy RLE and mask elements), which needs the resized pixels.
+bool icns_needs_pixels(uint32_t size, const IcnsOptions& options);
+
+// Validates ICNS element codes (e.g. "ic10", "it32") and adds them to
+// options.types; legacy RGB codes also turn on RLE for their size.
+bool select_icns_types(const std::vector<std::string>& types, IcnsOptions& options);
+
+// Encodes one PNG element the way write_icns does: small sizes are quantized
+// when options.quantize allows (and options.png.reduce is on), and
+// options.cache is consulted.
+PNGPayload encode_icon_png(const ImageView& img, const IcnsOptions& options);
+
+// Writes an .icns element by element with one gathered write per element.
+// The total length in the header is back-patched by finish() unless it was
+// supplied to open().
+class IcnsStreamWriter {
+public:
+  bool open(const char* filename, uint32_t total_size = 0, const OutputOptions& output = OutputOptions());
+  bool add(const char* type, const uint8_t* data, size_t size);
+  bool finish();
+  void discard() { out_.discard(); }
+
+private:
+  OutputFile out_;
+  uint32_t declared_total_ = 0;
+};
+
+// Images are taken as views, so they may live in one shared buffer or in PNGImages.
+bool write_icns(const char* filename, const std::vector<ImageView>& images, const IcnsOptions& options = IcnsOptions());
+bool write_icns(const char* filename, const std::vector<PNGImage>& images, const IcnsOptions& options = IcnsOptions());
+
+// Replaces or adds the elements for the sizes present in images inside an
+// existing .icns. Only those sizes are encoded; every other element is copied
+// as it is. A size keeps the element types the file already has for it. The
+// new file replaces the old one atomically, like any other output.
+bool update_icns(const char* filename, const std::vector<ImageView>& images, const IcnsOptions& options = IcnsOptions());
+bool update_icns(const char* filename, const std::vector<PNGImage>& images, const IcnsOptions& options = IcnsOptions());
+
+// One element of an ICNS file. offset/length locate the payload (after the
+// 8-byte element header) inside the file; nothing is copied when indexing.
+struct ICNSEntry {
+  char type[4];
+  size_t offset;
+  uint32_t length;
+};
+
+// Parses the element headers of an in-memory ICNS image into entries.
+bool index_icns(const uint8_t* data, size_t size, std::vector<ICNSEntry>& entries);
+
+// Read-only view of an .icns file: the file is memory-mapped, only the element
+// headers are parsed on open, and payloads are decoded on demand.
+class ICNSReader {
+public:
+  bool open(const std::string& filename);
+
+  const std::vector<ICNSEntry>& entries() const { return entries_; }
+  const ICNSEntry* find(const char* type) const;
+  const uint8_t* payload(const ICNSEntry& entry) const { return file_.data() + entry.offset; }
+
+  // False for metadata elements such as TOC, icnV or info, which carry no
+  // image; true for every icon type, supported or not, and for any PNG.
+  bool is_image(const ICNSEntry& entry) const;
+  // Decodes one element (PNG or legacy RLE with its mask) into pixels.
+  bool decode(const char* type, PNGImage& out) const;
+
+private:
+  std::string filename_;
+  MappedFile file_;
+  std::vector<ICNSEntry> entries_;
+};
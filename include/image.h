@@ -0,0 +1,84 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include "resize.h"
+
+enum class PixelLayout {
+  Interleaved, // One plane of RGBA quads
+  Planar       // Four planes: R, G, B, A
+};
+
+// Non-owning view of pixel memory. stride is the distance in bytes between
+// rows of the same plane. Views are cheap to copy and never free anything.
+struct ImageView {
+  PixelLayout layout = PixelLayout::Interleaved;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  size_t stride = 0;
+  uint8_t* planes[4] = { nullptr, nullptr, nullptr, nullptr };
+
+  uint8_t* row(uint32_t y, int plane = 0) const { return planes[plane] + y * stride; }
+
+  Pixel pixel(uint32_t x, uint32_t y) const {
+    if (layout == PixelLayout::Interleaved) {
+      const uint8_t* p = row(y) + x * 4;
+      return Pixel{ p[0], p[1], p[2], p[3] };
+    }
+    size_t o = y * stride + x;
+    return Pixel{ planes[0][o], planes[1][o], planes[2][o], planes[3][o] };
+  }
+
+  void set_pixel(uint32_t x, uint32_t y, Pixel px) const {
+    if (layout == PixelLayout::Interleaved) {
+      uint8_t* p = row(y) + x * 4;
+      p[0] = px.r; p[1] = px.g; p[2] = px.b; p[3] = px.a;
+      return;
+    }
+    size_t o = y * stride + x;
+    planes[0][o] = px.r; planes[1][o] = px.g; planes[2][o] = px.b; planes[3][o] = px.a;
+  }
+
+  // Wraps tightly packed RGBA memory such as PNGImage::pixels without copying.
+  static ImageView interleaved(const Pixel* pixels, uint32_t width, uint32_t height) {
+    ImageView v;
+    v.layout = PixelLayout::Interleaved;
+    v.width = width;
+    v.height = height;
+    v.stride = static_cast<size_t>(width) * 4;
+    v.planes[0] = reinterpret_cast<uint8_t*>(const_cast<Pixel*>(pixels));
+    return v;
+  }
+};
+
+// Owning pixel storage for SIMD kernels: every plane and every row starts on a
+// 64-byte boundary, with rows padded out to the stride.
+class ImageBuffer {
+public:
+  static const size_t kAlignment = 64;
+
+  ImageBuffer() = default;
+  ImageBuffer(uint32_t width, uint32_t height, PixelLayout layout) { reset(width, height, layout); }
+  ~ImageBuffer();
+  ImageBuffer(const ImageBuffer&) = delete;
+  ImageBuffer& operator=(const ImageBuffer&) = delete;
+  ImageBuffer(ImageBuffer&& other) noexcept;
+  ImageBuffer& operator=(ImageBuffer&& other) noexcept;
+
+  // Resizes the buffer, keeping the allocation when it is already large enough.
+  bool reset(uint32_t width, uint32_t height, PixelLayout layout);
+
+  ImageView view() const { return view_; }
+  uint32_t width() const { return view_.width; }
+  uint32_t height() const { return view_.height; }
+  PixelLayout layout() const { return view_.layout; }
+  size_t stride() const { return view_.stride; }
+
+private:
+  uint8_t* data_ = nullptr;
+  size_t capacity_ = 0;
+  ImageView view_;
+};
+
+// Copies pixels between views of equal size, converting layout as needed
+// (SSE2 deinterleave/interleave when available).
+void convert_layout(const ImageView& src, const ImageView& dst);
@@ -1,6 +1,9 @@
-#include <vector>
-#include <windows.h>
-#include <gdiplus.h>
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
 #include "png.h"
 
-bool load_jpeg_gdiplus(const wchar_t* filename, PNGImage& out);
+// Decodes a JPEG held in memory through GDI+. Only available on Windows;
+// elsewhere it reports that and returns false.
+bool decode_jpeg(const uint8_t* data, size_t size, const std::string& source, PNGImage& out);
@@ -0,0 +1,20 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// PNG row filters; Adaptive picks one of the five per row (minimum sum of
+// absolute differences, the usual libpng heuristic).
+enum class PngFilter : uint8_t { None = 0, Sub = 1, Up = 2, Average = 3, Paeth = 4, Adaptive = 5 };
+
+// Filters height rows of row_bytes each. src holds unfiltered rows, each
+// preceded by a filter-byte slot (stride row_bytes + 1); dst gets the same
+// layout with the filter bytes set. bpp is the filter's byte distance.
+void filter_scanlines(const uint8_t* src, uint8_t* dst, size_t row_bytes, uint32_t height, size_t bpp, PngFilter filter);
+
+// Brute-force search for the smallest zlib stream of the image: every filter
+// strategy against several zlib strategies, memory levels and window sizes plus
+// the builtin encoder, run in parallel. Candidates are started in order of how often they
+// win until time_budget_ms runs out (0 = no limit); at least one always runs.
+bool optimize_idat(const uint8_t* scanlines, size_t row_bytes, uint32_t height, size_t bpp,
+  uint32_t time_budget_ms, std::vector<uint8_t>& best);
@@ -0,0 +1,83 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// One piece of a gathered write
+struct IoSegment {
+  const void* data;
+  size_t size;
+};
+
+struct OutputOptions {
+  // Write to a sibling temporary file and rename it over the destination on
+  // close(), so readers only ever see the old file or the complete new one
+  bool atomic = true;
+  // Flush file data (and on POSIX the directory entry) to stable storage before
+  // close() returns
+  bool sync = false;
+  // Bypass the page cache (O_DIRECT / FILE_FLAG_NO_BUFFERING), staging writes in
+  // a large aligned buffer. Falls back to buffered I/O where unsupported.
+  bool direct_io = false;
+};
+
+// Binary output file with gathered (writev-style) appends and positional
+// back-patching. Every call reports failure instead of silently dropping data.
+// The name "-" writes to standard output instead: appends stream straight
+// through, but nothing can be back-patched or taken back once written.
+class OutputFile {
+public:
+  OutputFile() = default;
+  ~OutputFile();
+  OutputFile(const OutputFile&) = delete;
+  OutputFile& operator=(const OutputFile&) = delete;
+
+  bool open(const std::string& filename, const OutputOptions& options = OutputOptions());
+
+  // Appends all segments in order with as few system calls as the platform allows.
+  bool write(const IoSegment* segments, size_t count);
+  bool write(const void* data, size_t size) {
+    IoSegment seg{ data, size };
+    return write(&seg, 1);
+  }
+
+  // Overwrites bytes that were already appended, e.g. a length field in a header.
+  bool write_at(uint64_t offset, const void* data, size_t size);
+
+  // Flushes, optionally syncs, and publishes the file under its final name.
+  bool close();
+
+  // Drops everything written so far; an atomic output leaves the destination untouched.
+  void discard();
+
+  uint64_t position() const { return position_; }
+  const std::string& filename() const { return filename_; }
+  bool seekable() const { return !stream_; }
+
+private:
+  bool open_stream();
+  bool raw_write(const void* data, size_t size);
+  bool raw_write_at(uint64_t offset, const void* data, size_t size);
+  bool raw_read_at(uint64_t offset, void* data, size_t size);
+  bool flush_direct(bool final_block);
+  bool set_length(uint64_t length);
+  bool sync_handle();
+  bool close_handle();
+
+  std::string filename_;  // Final destination
+  std::string temp_name_; // File actually being written
+  OutputOptions options_;
+  uint64_t position_ = 0;
+  bool stream_ = false;   // Standard output
+
+  // Direct I/O staging: buffer_ holds bytes [flushed_, position_)
+  uint8_t* buffer_ = nullptr;
+  size_t buffered_ = 0;
+  uint64_t flushed_ = 0;
+
+#ifdef _WIN32
+  void* handle_ = nullptr;
+#else
+  int fd_ = -1;
+#endif
+};
@@ -0,0 +1,28 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "image.h"
+
+// A PNG pixel format in IHDR terms, plus the palette for colour type 3.
+struct PngFormat {
+  uint8_t color_type = 6;   // 0 grey, 2 RGB, 3 palette, 4 grey+alpha, 6 RGBA
+  uint8_t bit_depth = 8;
+  std::vector<Pixel> palette; // Colour type 3 only; translucent entries come first
+  size_t trns_count = 0;      // Leading palette entries that need a tRNS alpha
+};
+
+// Bytes per scanline of format f, without the filter byte.
+size_t png_row_bytes(uint32_t width, const PngFormat& f);
+// Byte distance the PNG filters use for format f (at least 1).
+size_t png_filter_bpp(const PngFormat& f);
+
+// Counts the distinct colours of img and picks the lossless format with the
+// smallest raw IDAT input: palette or grey at the lowest bit depth that holds
+// every value, RGB when opaque, RGBA otherwise.
+PngFormat choose_png_format(const ImageView& img);
+
+// Writes img in format f into height scanlines of png_row_bytes + 1 bytes,
+// leaving each row's leading filter byte at 0. f must come from
+// choose_png_format for the same pixels.
+bool pack_scanlines(const ImageView& img, const PngFormat& f, uint8_t* dst);
@@ -2,7 +2,9 @@
 #include <vector>
 #include <cstdint>
 #include <string>
+#include <memory>
 #include <resize.h>
+#include "image.h"
 
 struct PNGImage {
   uint32_t width = 0;
@@ -10,14 +12,51 @@ struct PNGImage {
   std::vector<Pixel> pixels;
 };
 
+// Encoded PNG bytes, shared between every ICNS entry that uses the same pixel size
+using PNGPayload = std::shared_ptr<const std::vector<uint8_t>>;
+
 struct ICNSChunk {
   char type[4];
-  std::vector<uint8_t> data;
+  PNGPayload data;
+};
+
+
+enum class DeflateBackend {
+  Zlib,    // Vendored zlib at level 9
+  Builtin  // In-tree encoder tuned for RGBA scanlines (see deflate.h)
+};
+
+struct PNGOptions {
+  DeflateBackend deflate = DeflateBackend::Zlib;
+  // Emit palette, grey or RGB instead of RGBA when no pixel changes (see palette.h)
+  bool reduce = true;
+  // Search filter strategies x deflate settings for the smallest output
+  // (see optimize.h); deflate is then only one of the candidates
+  bool optimize = false;
+  // Wall-clock budget per image for the search, 0 for no limit
+  uint32_t optimize_budget_ms = 10000;
 };
 
+// Identifies the encoder settings behind a payload, so caches never hand out
+// bytes produced with different options. 0 for the defaults.
+uint32_t png_options_key(const PNGOptions& options);
 
-static void write_chunk(std::ostream& out, const char* type, const std::vector<uint8_t>& data);
+// Encoders and decoders work on ImageView so callers can pass any pixel memory
+// (PNGImage::pixels, an ImageBuffer, a mapped file) without copying it first.
+bool encode_png(const ImageView& img, std::vector<uint8_t>& out, const PNGOptions& options = PNGOptions());
+bool encode_png(const std::vector<Pixel>& pixels, int width, int height, std::vector<uint8_t>& out);
+bool write_png(const std::string& filename, const ImageView& img);
 bool write_png(const std::string& filename, const std::vector<Pixel>& pixels, int width, int height);
+// Larger images are rejected from their IHDR before anything is allocated, so a
+// tiny file cannot claim gigabytes of pixels (16384x16384 RGBA is 1 GiB).
+const uint64_t kMaxPngPixels = 16384ull * 16384;
+// Reads the size from the IHDR chunk so a destination can be allocated up front.
+bool png_dimensions(const uint8_t* data, size_t size, uint32_t& width, uint32_t& height);
+// Decodes into caller-provided pixels; dst must already have the image's dimensions.
+// Every non-interlaced colour type and bit depth is expanded to RGBA.
+bool decode_png(const uint8_t* data, size_t size, const ImageView& dst, const std::string& filename = "<memory>");
+bool decode_png(const uint8_t* data, size_t size, PNGImage& out, const std::string& filename = "<memory>");
 bool load_simple_png(const std::string& filename, PNGImage& out);
+void resize_nn(const ImageView& src, const ImageView& dst);
 void resize_nn(const PNGImage& src, PNGImage& dst, uint32_t w, uint32_t h);
 std::string WideCharToUtf8(const wchar_t* wstr);
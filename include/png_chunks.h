@@ -0,0 +1,23 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// One chunk of a PNG held elsewhere, usually a memory-mapped file; parsing
+// only records where each chunk is, nothing is copied.
+struct PngChunk {
+  char type[4];
+  const uint8_t* data; // Chunk data (after the length and type fields)
+  uint32_t length;
+  uint32_t crc;        // As stored in the file
+};
+
+// Splits data into chunks up to and including IEND. With verify_crc every
+// stored CRC is checked and a mismatch fails the parse.
+bool parse_png_chunks(const uint8_t* data, size_t size, std::vector<PngChunk>& chunks, bool verify_crc = false);
+
+// Rewrites a PNG into its minimal equivalent: ancillary chunks other than
+// tRNS are dropped, consecutive IDATs become one, and CRCs are verified on
+// the way in and recomputed for merged chunks. The pixels are unchanged, and
+// the input is read once straight from its mapping into out.
+bool rewrite_png_chunks(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
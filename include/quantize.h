@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdint>
+#include "image.h"
+
+struct QuantizeOptions {
+  bool enabled = true;
+  // Floyd-Steinberg error diffusion when mapping pixels to the palette; smoother
+  // gradients, but the noise costs some of the size gain
+  bool dither = false;
+  // Largest pixel size quantized: 64 covers icp4, icp5, icp6 and the ic11/ic12
+  // elements that share their pixels
+  uint32_t max_size = 64;
+  // Alpha-weighted PSNR (dB) the palette image must reach, otherwise the exact
+  // pixels are kept
+  double min_psnr = 40.0;
+};
+
+// Lossy reduction to at most 256 RGBA colours: median cut over the colour
+// histogram, refined with a few k-means passes, then every pixel is mapped to
+// its nearest entry (SSE2 search behind a lookup cache). Fully transparent
+// pixels collapse to one transparent entry.
+//
+// Writes the palette image to dst (same size as src) and returns true; returns
+// false and leaves dst unspecified when src already has at most 256 colours
+// (lossless reduction covers it) or the result misses min_psnr.
+bool quantize_image(const ImageView& src, const ImageView& dst, const QuantizeOptions& options = QuantizeOptions());
@@ -6,5 +6,9 @@ struct Pixel {
   uint8_t r, g, b, a;
 };
 
+struct ImageView;
+
+void resize_image(const ImageView& src, const ImageView& dst);
 std::vector<Pixel> resize_image(const std::vector<Pixel>& src, int src_w, int src_h, int dst_w, int dst_h);
+void flatten_to_white(const ImageView& img);
 void flatten_to_white(std::vector<Pixel>& pixels);
@@ -0,0 +1,28 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "png.h"
+
+// Apple's PackBits variant used by the legacy ICNS elements:
+//   header 0x00-0x7F: copy the next (header + 1) literal bytes
+//   header 0x80-0xFF: repeat the next byte (header - 125) times (runs of 3-130)
+void packbits_encode(const uint8_t* src, size_t len, std::vector<uint8_t>& out);
+
+// Decodes exactly dst_len bytes; returns the number of source bytes consumed, or 0 on malformed input.
+size_t packbits_decode(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_len);
+
+// Encodes a 24-bit RLE element (is32/il32/ih32/it32). The red, green and blue
+// planes are compressed one after another; it32 additionally starts with four
+// zero bytes, which is what with_it32_header adds. Planar views are encoded in
+// place; interleaved ones are split into an aligned planar buffer first.
+bool encode_icns_rle(const ImageView& img, std::vector<uint8_t>& out, bool with_it32_header);
+bool encode_icns_rle(const PNGImage& img, std::vector<uint8_t>& out, bool with_it32_header);
+
+// Decodes a 24-bit RLE element of the given square size. mask may be null
+// (fully opaque) or point at size * size alpha bytes from the matching mask element.
+bool decode_icns_rle(const uint8_t* data, size_t len, uint32_t size, const uint8_t* mask, bool with_it32_header, PNGImage& out);
+
+// Encodes an 8-bit mask element (s8mk/l8mk/h8mk/t8mk): the raw alpha plane.
+bool encode_icns_mask(const ImageView& img, std::vector<uint8_t>& out);
+bool encode_icns_mask(const PNGImage& img, std::vector<uint8_t>& out);
@@ -0,0 +1,68 @@
+#pragma once
+#include <cstdint>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "icns.h"
+
+// Encoded PNG payloads for one set of resized images, shared by every
+// container written from them: each pixel size is encoded at most once per
+// run, however many files reference it.
+class PayloadSet {
+public:
+  explicit PayloadSet(const IcnsOptions& options) : options_(options) {
+    options_.payloads = nullptr;
+  }
+
+  // The payload for img, encoding it on the first request for its size.
+  // Thread-safe; concurrent callers for the same size wait for one encode.
+  PNGPayload get(const ImageView& img);
+
+  // Starts encoding the given images in the background.
+  void prefetch(const std::vector<ImageView>& images);
+
+private:
+  using Key = std::pair<uint32_t, uint32_t>; // (width, height)
+
+  IcnsOptions options_;
+  std::mutex mutex_;
+  std::map<Key, std::shared_future<PNGPayload>> payloads_;
+  std::vector<std::future<void>> pending_;
+};
+
+enum class IconContainer {
+  Icns,    // macOS .icns
+  Iconset, // Directory of icon_<n>x<n>[@2x].png files for iconutil
+  Ico,     // Windows .ico
+  Cur      // Windows .cur (an .ico with a hotspot per image)
+};
+
+struct OutputTarget {
+  IconContainer container = IconContainer::Icns;
+  std::string path;
+};
+
+// Picks the container from the extension (.ico, .cur, .iconset); anything else,
+// including "-", is written as ICNS.
+OutputTarget output_target(const std::string& path);
+// "ICNS file", "ICO file", "Cursor file" or "Iconset", for messages
+const char* container_name(IconContainer container);
+
+// Pixel sizes a container needs images for.
+std::vector<uint32_t> target_sizes(IconContainer container, const IcnsOptions& options);
+// Whether the container reads the pixels of size, rather than only its PNG payload.
+bool target_needs_pixels(IconContainer container, uint32_t size, const IcnsOptions& options);
+
+// Writes every target from the same images and payloads. Stops at the first
+// failure; targets already written are kept.
+bool write_targets(const std::vector<OutputTarget>& targets, const std::vector<ImageView>& images, const IcnsOptions& options);
+
+bool write_iconset(const std::string& directory, const std::vector<ImageView>& images, const IcnsOptions& options);
+// Entries below 256 px are 32-bit BMP/DIB images with a 1-bit AND mask, which
+// every Windows version and icon editor reads; 256 px entries are PNG streams.
+bool write_ico(const std::string& filename, const std::vector<ImageView>& images, const IcnsOptions& options);
+// The same laid out as a cursor, with options.hotspot_x/y scaled to each size.
+bool write_cur(const std::string& filename, const std::vector<ImageView>& images, const IcnsOptions& options);
@@ -1,9 +1,28 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 
 void write_be_uint32(uint8_t* buf, uint32_t val);
+uint32_t read_be_uint32(const uint8_t* buf);
+
+// 64-bit content hash used to key cached payloads (not cryptographic).
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed = 0);
+
+// True for "-", which names standard input or output on the command line
+inline bool is_stdio_path(const std::string& path) { return path == "-"; }
+
+// Heap blocks with the given power-of-two alignment (SIMD rows, direct I/O buffers)
+void* aligned_malloc(size_t size, size_t alignment);
+void aligned_free(void* ptr);
+
+#ifdef _WIN32
+// Converts a UTF-8 path to UTF-16 for the wide Win32 file APIs
+std::wstring utf8_to_wide(const std::string& str);
+std::string wide_to_utf8(const std::wstring& wstr);
+#endif
 
 #ifdef _DEBUG
 void debug_log(const char* format, ...);
@@ -0,0 +1,44 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "convert.h"
+
+// Change notifications for the files of one directory (not recursive):
+// inotify on Linux, ReadDirectoryChangesW on Windows, and a periodic scan of
+// modification times elsewhere.
+class DirectoryWatcher {
+public:
+  DirectoryWatcher() = default;
+  ~DirectoryWatcher();
+  DirectoryWatcher(const DirectoryWatcher&) = delete;
+  DirectoryWatcher& operator=(const DirectoryWatcher&) = delete;
+
+  bool open(const std::string& directory);
+
+  // Waits up to timeout_ms (-1 = forever) and appends the names of files that
+  // changed. An empty name means events were lost and everything should be
+  // rescanned. Returns false only on a watcher error.
+  bool wait(int timeout_ms, std::vector<std::string>& changed);
+
+private:
+  std::string directory_;
+#if defined(_WIN32)
+  void* handle_ = nullptr;
+  void* event_ = nullptr;
+  void* overlapped_ = nullptr;
+  std::vector<uint32_t> buffer_;
+  bool issue();
+#elif defined(__linux__)
+  int fd_ = -1;
+#else
+  std::vector<std::pair<std::string, int64_t>> snapshot_;
+  void scan(std::vector<std::pair<std::string, int64_t>>& out) const;
+#endif
+};
+
+// Converts job.input (a file, or every image in a directory into job.output as
+// a directory) and then re-converts sources as they change, until the process
+// is interrupted. Bursts of writes are coalesced over job.debounce_ms, and a
+// source whose bytes did not change is not converted again.
+int run_watch(const ConvertJob& job, PayloadCache* cache);
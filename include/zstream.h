@@ -0,0 +1,55 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <zlib.h>
+
+// Parameters fixed at deflateInit2 time; streams are pooled per combination.
+struct DeflateSettings {
+  int level = Z_BEST_COMPRESSION;
+  int window_bits = 15;
+  int mem_level = 8;
+  int strategy = Z_DEFAULT_STRATEGY;
+
+  bool operator==(const DeflateSettings& o) const {
+    return level == o.level && window_bits == o.window_bits && mem_level == o.mem_level && strategy == o.strategy;
+  }
+};
+
+// Borrows an initialised deflate stream from a process-wide pool and hands it
+// back, reset with deflateReset, when it goes out of scope. The window and hash
+// tables (~270 KB at level 9) are allocated once per concurrent user instead of
+// once per icon. Streams are heap-allocated and never use a ScratchArena, since
+// they outlive every arena reset.
+class DeflateStream {
+public:
+  explicit DeflateStream(const DeflateSettings& settings = DeflateSettings());
+  ~DeflateStream();
+  DeflateStream(const DeflateStream&) = delete;
+  DeflateStream& operator=(const DeflateStream&) = delete;
+
+  bool ok() const { return stream_ != nullptr; }
+  z_stream* get() { return stream_; }
+
+  // Compresses src in one call into dst, which holds dst_len bytes (use
+  // deflateBound or compressBound); dst_len receives the compressed size.
+  bool compress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t& dst_len);
+
+private:
+  DeflateSettings settings_;
+  z_stream* stream_;
+};
+
+// Pooled inflate stream, reset with inflateReset when returned.
+class InflateStream {
+public:
+  InflateStream();
+  ~InflateStream();
+  InflateStream(const InflateStream&) = delete;
+  InflateStream& operator=(const InflateStream&) = delete;
+
+  bool ok() const { return stream_ != nullptr; }
+  z_stream* get() { return stream_; }
+
+private:
+  z_stream* stream_;
+};
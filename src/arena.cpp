@@ -0,0 +1,124 @@
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include "arena.h"
+#include "utils.h"
+
+// Smallest block requested from the system; most icon scratch fits in one
+static const size_t kMinBlockSize = 1 << 20;
+// Arenas that grew beyond this are freed instead of being returned to the pool
+static const size_t kMaxRetained = 64u << 20;
+
+static size_t align_up(size_t n, size_t alignment) {
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+ScratchArena::~ScratchArena() {
+  release();
+}
+
+void* ScratchArena::allocate(size_t size, size_t alignment) {
+  if (size == 0) {
+    size = 1;
+  }
+
+  if (!blocks_.empty()) {
+    Block& b = blocks_.back();
+    size_t offset = align_up(b.used, alignment);
+    if (offset <= b.size && size <= b.size - offset) {
+      b.used = offset + size;
+      return b.data + offset;
+    }
+  }
+
+  // Grow geometrically so a run needs few blocks before reset() merges them
+  size_t block_size = align_up(size, kAlignment);
+  size_t grown = blocks_.empty() ? kMinBlockSize : blocks_.back().size * 2;
+  if (block_size < grown) {
+    block_size = grown;
+  }
+  uint8_t* data = static_cast<uint8_t*>(aligned_malloc(block_size, alignment > kAlignment ? alignment : kAlignment));
+  if (!data) {
+    std::cerr << "ScratchArena: Failed to allocate " << block_size << " bytes\n";
+    return nullptr;
+  }
+  blocks_.push_back({ data, block_size, size });
+  return data;
+}
+
+ImageView ScratchArena::allocate_image(uint32_t width, uint32_t height, PixelLayout layout) {
+  const int plane_count = layout == PixelLayout::Planar ? 4 : 1;
+  const size_t row_bytes = static_cast<size_t>(width) * (layout == PixelLayout::Planar ? 1 : 4);
+  const size_t stride = align_up(row_bytes == 0 ? 1 : row_bytes, kAlignment);
+  const size_t plane_size = stride * height;
+
+  ImageView view;
+  uint8_t* data = static_cast<uint8_t*>(allocate(plane_size * plane_count));
+  if (!data) {
+    return view;
+  }
+  view.layout = layout;
+  view.width = width;
+  view.height = height;
+  view.stride = stride;
+  for (int p = 0; p < plane_count; ++p) {
+    view.planes[p] = data + p * plane_size;
+  }
+  return view;
+}
+
+void ScratchArena::reset() {
+  if (blocks_.size() > 1) {
+    size_t total = capacity();
+    release();
+    uint8_t* data = static_cast<uint8_t*>(aligned_malloc(total, kAlignment));
+    if (data) {
+      blocks_.push_back({ data, total, 0 });
+    }
+    debug_log("ScratchArena: merged blocks into %zu bytes", total);
+    return;
+  }
+  for (auto& b : blocks_) {
+    b.used = 0;
+  }
+}
+
+void ScratchArena::release() {
+  for (auto& b : blocks_) {
+    aligned_free(b.data);
+  }
+  blocks_.clear();
+}
+
+size_t ScratchArena::capacity() const {
+  size_t total = 0;
+  for (const auto& b : blocks_) {
+    total += b.size;
+  }
+  return total;
+}
+
+static std::mutex pool_mutex;
+static std::vector<std::unique_ptr<ScratchArena>> pool;
+
+ScratchLease::ScratchLease() {
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  if (pool.empty()) {
+    arena_ = new ScratchArena();
+  }
+  else {
+    arena_ = pool.back().release();
+    pool.pop_back();
+  }
+}
+
+ScratchLease::~ScratchLease() {
+  if (arena_->capacity() > kMaxRetained) {
+    arena_->release();
+  }
+  else {
+    arena_->reset();
+  }
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  pool.emplace_back(arena_);
+}
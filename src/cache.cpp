@@ -0,0 +1,184 @@
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include "cache.h"
+#include "arena.h"
+#include "output.h"
+#include "png_chunks.h"
+#include "utils.h"
+
+PayloadCache::PayloadCache(std::string directory) : directory_(std::move(directory)) {
+  if (!directory_.empty()) {
+    std::error_code ec;
+    std::filesystem::create_directories(directory_, ec);
+    if (ec) {
+      std::cerr << "PayloadCache: Failed to create cache directory " << directory_ << ", caching in memory only\n";
+      directory_.clear();
+    }
+  }
+}
+
+// Hashes the pixels as tightly packed RGBA, so padded strides and planar views of
+// the same image produce the same key; only those need a packed copy. Fails
+// when that copy cannot be allocated.
+static bool hash_view(const ImageView& img, uint64_t& hash) {
+  const size_t row_bytes = static_cast<size_t>(img.width) * 4;
+  if (img.layout == PixelLayout::Interleaved && img.stride == row_bytes) {
+    hash = hash_bytes(img.planes[0], row_bytes * img.height);
+    return true;
+  }
+
+  ScratchLease scratch;
+  Pixel* packed = scratch->allocate_array<Pixel>(static_cast<size_t>(img.width) * img.height);
+  if (!packed) {
+    return false;
+  }
+  convert_layout(img, ImageView::interleaved(packed, img.width, img.height));
+  hash = hash_bytes(packed, row_bytes * img.height);
+  return true;
+}
+
+PNGPayload PayloadCache::get_or_encode(const PNGImage& img, const PNGOptions& options) {
+  return get_or_encode(ImageView::interleaved(img.pixels.data(), img.width, img.height), options);
+}
+
+PNGPayload PayloadCache::get_or_encode(const ImageView& img, const PNGOptions& options) {
+  uint64_t hash;
+  if (!hash_view(img, hash)) {
+    // Without a key the cache cannot be used safely; encode directly
+    debug_log("PayloadCache: cannot hash %ux%u, bypassing the cache", img.width, img.height);
+    auto encoded = std::make_shared<std::vector<uint8_t>>();
+    if (!encode_png(img, *encoded, options)) {
+      return nullptr;
+    }
+    return encoded;
+  }
+  Key key{ hash, img.width, img.height, png_options_key(options) };
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      hits_++;
+      debug_log("PayloadCache: memory hit for %ux%u (%016llx)", img.width, img.height, (unsigned long long)key.hash);
+      return it->second;
+    }
+  }
+
+  bool from_disk = true;
+  PNGPayload payload = load_from_disk(key);
+  if (!payload) {
+    from_disk = false;
+    auto encoded = std::make_shared<std::vector<uint8_t>>();
+    if (!encode_png(img, *encoded, options)) {
+      return nullptr;
+    }
+    store_to_disk(key, *encoded);
+    payload = std::move(encoded);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (from_disk) {
+    hits_++;
+    debug_log("PayloadCache: disk hit for %ux%u (%016llx)", img.width, img.height, (unsigned long long)key.hash);
+  }
+  else {
+    misses_++;
+    debug_log("PayloadCache: encoded %ux%u (%016llx), %zu bytes", img.width, img.height, (unsigned long long)key.hash, payload->size());
+  }
+  if (memory_limit_ != 0 && memory_used_ + payload->size() > memory_limit_) {
+    debug_log("PayloadCache: memory limit reached, dropping %zu entries", entries_.size());
+    entries_.clear();
+    memory_used_ = 0;
+  }
+  if (entries_.emplace(key, payload).second) {
+    memory_used_ += payload->size();
+  }
+  return payload;
+}
+
+// Each entry file starts with the full key it was stored under, so a file
+// that does not belong to the key (another build, a renamed file) is a miss:
+// "ICPC", format version, hash (high, low), width, height, variant
+static const uint32_t kEntryVersion = 1;
+static const size_t kEntryHeaderSize = 28;
+
+static void write_entry_header(uint8_t* out, uint64_t hash, uint32_t width, uint32_t height, uint32_t variant) {
+  std::memcpy(out, "ICPC", 4);
+  write_be_uint32(out + 4, kEntryVersion);
+  write_be_uint32(out + 8, static_cast<uint32_t>(hash >> 32));
+  write_be_uint32(out + 12, static_cast<uint32_t>(hash));
+  write_be_uint32(out + 16, width);
+  write_be_uint32(out + 20, height);
+  write_be_uint32(out + 24, variant);
+}
+
+std::string PayloadCache::path_for(const Key& key) const {
+  // Default-encoder entries keep the plain name; other variants get a suffix
+  char name[80];
+  if (key.variant == 0) {
+    std::snprintf(name, sizeof(name), "%016llx_%ux%u.icpc", (unsigned long long)key.hash, key.width, key.height);
+  }
+  else {
+    std::snprintf(name, sizeof(name), "%016llx_%ux%u_v%x.icpc", (unsigned long long)key.hash, key.width, key.height, key.variant);
+  }
+  return (std::filesystem::path(directory_) / name).string();
+}
+
+PNGPayload PayloadCache::load_from_disk(const Key& key) const {
+  if (directory_.empty()) {
+    return nullptr;
+  }
+
+  std::ifstream in(path_for(key), std::ios::binary | std::ios::ate);
+  if (!in.is_open()) {
+    return nullptr;
+  }
+
+  std::streampos sz = in.tellg();
+  if (sz < static_cast<std::streampos>(kEntryHeaderSize + 8)) {
+    return nullptr;
+  }
+  uint8_t header[kEntryHeaderSize], expected[kEntryHeaderSize];
+  in.seekg(0, std::ios::beg);
+  in.read(reinterpret_cast<char*>(header), kEntryHeaderSize);
+  write_entry_header(expected, key.hash, key.width, key.height, key.variant);
+  if (!in || std::memcmp(header, expected, kEntryHeaderSize) != 0) {
+    debug_log("PayloadCache: %s was stored under a different key", path_for(key).c_str());
+    return nullptr;
+  }
+  auto data = std::make_shared<std::vector<uint8_t>>(static_cast<size_t>(sz) - kEntryHeaderSize);
+  in.read(reinterpret_cast<char*>(data->data()), data->size());
+
+  // A truncated, corrupt or foreign file is treated as a miss and overwritten
+  // later: every chunk CRC must match through to IEND, and the PNG must have
+  // the key's dimensions
+  std::vector<PngChunk> chunks;
+  uint32_t width = 0, height = 0;
+  if (!in || !parse_png_chunks(data->data(), data->size(), chunks, true) ||
+    !png_dimensions(data->data(), data->size(), width, height) || width != key.width || height != key.height) {
+    debug_log("PayloadCache: ignoring invalid cache file %s", path_for(key).c_str());
+    return nullptr;
+  }
+  return data;
+}
+
+void PayloadCache::store_to_disk(const Key& key, const std::vector<uint8_t>& data) const {
+  if (directory_.empty()) {
+    return;
+  }
+
+  // OutputFile writes under a unique temporary name and renames it into place,
+  // so processes and threads sharing the directory never see or publish a
+  // partial entry
+  uint8_t header[kEntryHeaderSize];
+  write_entry_header(header, key.hash, key.width, key.height, key.variant);
+  IoSegment segments[2] = { { header, kEntryHeaderSize }, { data.data(), data.size() } };
+  OutputFile out;
+  if (!out.open(path_for(key)) || !out.write(segments, 2) || !out.close()) {
+    std::cerr << "PayloadCache: Failed to write cache entry " << path_for(key) << "\n";
+  }
+}
@@ -0,0 +1,553 @@
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <memory>
+#include <fstream>
+#include <sstream>
+
+#ifdef _DEBUG
+#include <filesystem>
+#endif
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "convert.h"
+#include "decoder.h"
+#include "mapped_file.h"
+#include "png.h"
+#include "png_chunks.h"
+#include "utils.h"
+
+bool load_image(const char* filename, PNGImage& out) {
+  if (is_stdio_path(filename)) {
+    std::vector<uint8_t> data;
+    return read_stdin(data) && decode_image(data.data(), data.size(), "<stdin>", out);
+  }
+
+  // Opened once and mapped; the decoder is picked from the leading bytes
+  MappedFile file;
+  if (!file.open(filename)) {
+    std::fprintf(stderr, "Error: Cannot open file %s (file may not exist or is inaccessible)\n", filename);
+    return false;
+  }
+  return decode_image(file.data(), file.size(), filename, out);
+}
+
+bool read_stdin(std::vector<uint8_t>& out) {
+#ifdef _WIN32
+  // The CRT would otherwise translate CR/LF and stop at ^Z
+  _setmode(_fileno(stdin), _O_BINARY);
+#endif
+  out.clear();
+  size_t used = 0;
+  while (true) {
+    if (out.size() - used < 64 * 1024) {
+      out.resize(std::max<size_t>(out.size() * 2, 256 * 1024));
+    }
+    size_t n = std::fread(out.data() + used, 1, out.size() - used, stdin);
+    used += n;
+    if (n == 0) break;
+  }
+  out.resize(used);
+  if (std::ferror(stdin)) {
+    std::fprintf(stderr, "Error: Failed to read standard input\n");
+    return false;
+  }
+  if (out.empty()) {
+    std::fprintf(stderr, "Error: Standard input is empty\n");
+    return false;
+  }
+  return true;
+}
+
+// Parses a comma separated list of pixel sizes, e.g. "16,32"
+static bool parse_size_list(const char* arg, std::vector<uint32_t>& out) {
+  std::string list(arg);
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) end = list.size();
+    std::string item = list.substr(start, end - start);
+    char* parse_end = nullptr;
+    unsigned long value = std::strtoul(item.c_str(), &parse_end, 10);
+    if (item.empty() || *parse_end != '\0' || value == 0 || value > 1024) {
+      std::fprintf(stderr, "Error: Invalid size '%s' in list %s\n", item.c_str(), arg);
+      return false;
+    }
+    out.push_back(static_cast<uint32_t>(value));
+    start = end + 1;
+  }
+  return true;
+}
+
+// Splits a comma separated list, e.g. "ic10,ic09"
+static std::vector<std::string> split_list(const std::string& list) {
+  std::vector<std::string> items;
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) end = list.size();
+    items.push_back(list.substr(start, end - start));
+    start = end + 1;
+  }
+  return items;
+}
+
+// Reads the options stored in a profile file: the same flags as on the command
+// line, separated by whitespace, with # starting a comment
+static bool read_profile(const std::string& path, std::vector<std::string>& out) {
+  std::ifstream in(path);
+  if (!in) {
+    std::fprintf(stderr, "Error: Cannot open profile %s\n", path.c_str());
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream words(line);
+    std::string word;
+    while (words >> word) out.push_back(word);
+  }
+  return true;
+}
+
+bool parse_convert_args(const std::vector<std::string>& command_line, ConvertJob& job) {
+  // Profiles are expanded in place, so later flags override what they set
+  std::vector<std::string> args = command_line;
+  int profiles = 0;
+  if (args.size() < 2) {
+    std::fprintf(stderr, "Error: Expected an input and an output file\n");
+    return false;
+  }
+  job.input = args[0];
+  job.output = args[1];
+  job.targets.push_back(output_target(job.output));
+
+  IcnsOptions& options = job.options;
+  for (size_t i = 2; i < args.size(); ++i) {
+    const char* arg = args[i].c_str();
+    const bool has_value = i + 1 < args.size();
+    if (std::strcmp(arg, "--cache") == 0 && has_value) {
+      job.cache_dir = args[++i];
+    }
+    else if (std::strcmp(arg, "--fsync") == 0) {
+      options.output.sync = true;
+    }
+    else if (std::strcmp(arg, "--direct-io") == 0) {
+      options.output.direct_io = true;
+    }
+    else if (std::strcmp(arg, "--optimize") == 0) {
+      options.png.optimize = true;
+    }
+    else if (std::strcmp(arg, "--no-reduce") == 0) {
+      options.png.reduce = false;
+    }
+    else if (std::strcmp(arg, "--no-quantize") == 0) {
+      options.quantize.enabled = false;
+    }
+    else if (std::strcmp(arg, "--dither") == 0) {
+      options.quantize.dither = true;
+    }
+    else if (std::strcmp(arg, "--quantize-quality") == 0 && has_value) {
+      const char* value = args[++i].c_str();
+      char* end = nullptr;
+      double db = std::strtod(value, &end);
+      if (*end != '\0' || db < 0) {
+        std::fprintf(stderr, "Error: Invalid quantization quality %s\n", value);
+        return false;
+      }
+      options.quantize.min_psnr = db;
+    }
+    else if (std::strcmp(arg, "--optimize-time") == 0 && has_value) {
+      const char* value = args[++i].c_str();
+      char* end = nullptr;
+      double seconds = std::strtod(value, &end);
+      if (*end != '\0' || !(seconds >= 0)) {
+        std::fprintf(stderr, "Error: Invalid time budget %s\n", value);
+        return false;
+      }
+      // 0 means no limit, so any positive budget is at least 1 ms
+      double ms = std::ceil(seconds * 1000);
+      options.png.optimize = true;
+      options.png.optimize_budget_ms = ms >= UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(ms);
+    }
+    else if (std::strcmp(arg, "--deflate") == 0 && has_value) {
+      const char* backend = args[++i].c_str();
+      if (std::strcmp(backend, "zlib") == 0) {
+        options.png.deflate = DeflateBackend::Zlib;
+      }
+      else if (std::strcmp(backend, "builtin") == 0) {
+        options.png.deflate = DeflateBackend::Builtin;
+      }
+      else {
+        std::fprintf(stderr, "Error: Unknown deflate backend %s (use zlib or builtin)\n", backend);
+        return false;
+      }
+    }
+    else if (std::strcmp(arg, "--profile") == 0 && has_value) {
+      std::vector<std::string> profile;
+      if (++profiles > 16 || !read_profile(args[i + 1], profile)) {
+        if (profiles > 16) std::fprintf(stderr, "Error: Too many nested profiles\n");
+        return false;
+      }
+      args.erase(args.begin() + i, args.begin() + i + 2);
+      args.insert(args.begin() + i, profile.begin(), profile.end());
+      --i;
+    }
+    else if (std::strcmp(arg, "--sizes") == 0 && has_value) {
+      options.sizes.clear();
+      if (!parse_size_list(args[++i].c_str(), options.sizes)) return false;
+    }
+    else if (std::strcmp(arg, "--types") == 0 && has_value) {
+      options.types.clear();
+      if (!select_icns_types(split_list(args[++i]), options)) return false;
+    }
+    else if (std::strcmp(arg, "--size") == 0 && has_value) {
+      const std::string& value = args[++i];
+      size_t eq = value.find('=');
+      char* end = nullptr;
+      unsigned long size = std::strtoul(value.c_str(), &end, 10);
+      if (eq == std::string::npos || end != value.c_str() + eq || size == 0 || size > 1024 || eq + 1 == value.size()) {
+        std::fprintf(stderr, "Error: Invalid size source %s (expected size=file)\n", value.c_str());
+        return false;
+      }
+      if (is_stdio_path(value.substr(eq + 1))) {
+        std::fprintf(stderr, "Error: Only the main input can be -\n");
+        return false;
+      }
+      job.size_sources.emplace_back(static_cast<uint32_t>(size), value.substr(eq + 1));
+    }
+    else if (std::strcmp(arg, "--output") == 0 && has_value) {
+      job.targets.push_back(output_target(args[++i]));
+    }
+    else if (std::strcmp(arg, "--hotspot") == 0 && has_value) {
+      const char* value = args[++i].c_str();
+      unsigned x = 0, y = 0;
+      char tail = 0;
+      if (std::sscanf(value, "%u,%u%c", &x, &y, &tail) != 2) {
+        std::fprintf(stderr, "Error: Invalid hotspot %s (expected x,y)\n", value);
+        return false;
+      }
+      job.hotspot_x = x;
+      job.hotspot_y = y;
+    }
+    else if (std::strcmp(arg, "--passthrough") == 0) {
+      job.passthrough = true;
+    }
+    else if (std::strcmp(arg, "--strip-chunks") == 0) {
+      job.passthrough = true;
+      job.strip_chunks = true;
+    }
+    else if (std::strcmp(arg, "--watch") == 0) {
+      job.watch = true;
+    }
+    else if (std::strcmp(arg, "--debounce") == 0 && has_value) {
+      const char* value = args[++i].c_str();
+      char* end = nullptr;
+      unsigned long ms = std::strtoul(value, &end, 10);
+      if (*end != '\0' || ms > 60000) {
+        std::fprintf(stderr, "Error: Invalid debounce interval %s\n", value);
+        return false;
+      }
+      job.debounce_ms = static_cast<uint32_t>(ms);
+    }
+    else if (std::strcmp(arg, "--update") == 0 && has_value) {
+      if (!parse_size_list(args[++i].c_str(), job.update_sizes)) return false;
+    }
+    else if (std::strcmp(arg, "--rle") == 0 && has_value) {
+      if (!parse_size_list(args[++i].c_str(), options.rle_sizes)) return false;
+      for (uint32_t sz : options.rle_sizes) {
+        if (sz != 16 && sz != 32 && sz != 48 && sz != 128) {
+          std::fprintf(stderr, "Error: RLE elements exist only for 16, 32, 48 and 128 (got %u)\n", sz);
+          return false;
+        }
+      }
+    }
+    else {
+      std::fprintf(stderr, "Error: Unknown option %s\n", arg);
+      return false;
+    }
+  }
+
+  // "-" streams through standard input/output, which cannot be re-read or patched in place
+  if (job.watch && (is_stdio_path(job.input) || is_stdio_path(job.output))) {
+    std::fprintf(stderr, "Error: --watch needs a real input and output, not -\n");
+    return false;
+  }
+  if (!job.update_sizes.empty() && is_stdio_path(job.output)) {
+    std::fprintf(stderr, "Error: --update needs an existing output file, not -\n");
+    return false;
+  }
+  if (!job.update_sizes.empty() && (job.targets.size() > 1 || job.targets[0].container != IconContainer::Icns)) {
+    std::fprintf(stderr, "Error: --update only patches a single .icns output\n");
+    return false;
+  }
+  for (size_t i = 1; i < job.targets.size(); ++i) {
+    if (is_stdio_path(job.targets[i].path)) {
+      std::fprintf(stderr, "Error: Only the main output can be -\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+namespace {
+
+// One source file: its encoded bytes, its dimensions from the header, and its
+// pixels once some size actually needs them
+struct Source {
+  std::string name;
+  MappedFile file;             // Owns the bytes of a file source
+  std::vector<uint8_t> buffer; // Owns standard input
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  PNGImage image;
+  bool decoded = false;
+
+  bool load(const std::string& path) {
+    name = path;
+    if (is_stdio_path(path)) {
+      if (!read_stdin(buffer)) return false;
+      data = buffer.data();
+      size = buffer.size();
+      return true;
+    }
+    if (!file.open(path)) {
+      std::fprintf(stderr, "Error: Cannot open file %s (file may not exist or is inaccessible)\n", path.c_str());
+      return false;
+    }
+    data = file.data();
+    size = file.size();
+    return true;
+  }
+
+  // PNG dimensions come from IHDR; other formats are decoded to learn them
+  bool read_dimensions() {
+    if (png_dimensions(data, size, width, height)) return true;
+    if (!pixels()) return false;
+    width = image.width;
+    height = image.height;
+    return true;
+  }
+
+  const PNGImage* pixels() {
+    if (!decoded) {
+      if (!decode_image(data, size, name, image)) return nullptr;
+      decoded = true;
+    }
+    return &image;
+  }
+
+  // A non-interlaced PNG of exactly size x size can be embedded as it is, as
+  // long as it is intact: every CRC matches and the chunks run from IHDR to
+  // IEND. length is where IEND ends, so trailing bytes are left out.
+  bool embeddable_as(uint32_t sz, size_t& length) const {
+    uint32_t w, h;
+    if (!png_dimensions(data, size, w, h) || w != sz || h != sz || data[28] != 0) {
+      return false;
+    }
+    std::vector<PngChunk> chunks;
+    if (!parse_png_chunks(data, size, chunks, true) || std::memcmp(chunks.front().type, "IHDR", 4) != 0) {
+      std::fprintf(stderr, "Warning: %s is damaged; re-encoding it instead of embedding it\n", name.c_str());
+      return false;
+    }
+    const PngChunk& iend = chunks.back();
+    length = static_cast<size_t>(iend.data + iend.length + 4 - data);
+    return true;
+  }
+};
+
+} // namespace
+
+static bool convert_sources(const ConvertJob& job, const std::vector<std::shared_ptr<Source>>& sources, PayloadCache* cache) {
+  Source& original = *sources[0];
+  IcnsOptions options = job.options;
+  if (cache) options.cache = cache;
+  options.hotspot_x = static_cast<float>(job.hotspot_x) / original.width;
+  options.hotspot_y = static_cast<float>(job.hotspot_y) / original.height;
+
+  // Every size any target needs is resized once and shared between them
+  std::vector<uint32_t> sizes;
+  for (const OutputTarget& t : job.targets) {
+    for (uint32_t sz : target_sizes(t.container, options)) {
+      if (std::find(sizes.begin(), sizes.end(), sz) == sizes.end()) sizes.push_back(sz);
+    }
+  }
+  // --update only re-encodes the listed sizes and splices them into the existing file
+  if (!job.update_sizes.empty()) {
+    sizes = job.update_sizes;
+  }
+
+  auto source_for = [&](uint32_t sz) -> Source* {
+    for (size_t i = 0; i < job.size_sources.size(); ++i) {
+      if (job.size_sources[i].first == sz) return sources[i + 1].get();
+    }
+    // Otherwise the smallest source that is at least as large, so downscaling
+    // starts from the closest artwork; the largest one when all are smaller
+    Source* best = nullptr;
+    for (auto& c : sources) {
+      const uint32_t side = std::min(c->width, c->height);
+      const uint32_t best_side = best ? std::min(best->width, best->height) : 0;
+      bool better = !best ||
+        (side >= sz ? (best_side < sz || side < best_side) : (best_side < sz && side > best_side));
+      if (better) best = c.get();
+    }
+    return best;
+  };
+
+  // With --passthrough a source PNG that already has a target's exact size is
+  // embedded byte for byte; its size is then only decoded and resized if some
+  // container stores it as something other than PNG (RLE, a BMP in an .ico)
+  std::vector<Source*> chosen;
+  std::vector<bool> resize(sizes.size(), true);
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    const uint32_t sz = sizes[i];
+    chosen.push_back(source_for(sz));
+    size_t length = 0;
+    if (!job.passthrough || !chosen[i]->embeddable_as(sz, length)) {
+      continue;
+    }
+    auto payload = std::make_shared<std::vector<uint8_t>>();
+    if (job.strip_chunks) {
+      if (!rewrite_png_chunks(chosen[i]->data, length, *payload)) {
+        std::fprintf(stderr, "Error: Cannot rewrite the chunks of %s\n", chosen[i]->name.c_str());
+        return false;
+      }
+    }
+    else {
+      payload->assign(chosen[i]->data, chosen[i]->data + length);
+    }
+    debug_log("Size %u embeds %s unchanged (%zu bytes)", sz, chosen[i]->name.c_str(), payload->size());
+    options.png_passthrough[sz] = std::move(payload);
+    resize[i] = false;
+    for (const OutputTarget& t : job.targets) {
+      resize[i] = resize[i] || target_needs_pixels(t.container, sz, options);
+    }
+  }
+
+  // Every size is resized into one shared buffer, so the whole conversion makes
+  // a fixed number of pixel allocations regardless of how many sizes are written
+  size_t total_pixels = 0;
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    if (resize[i]) total_pixels += static_cast<size_t>(sizes[i]) * sizes[i];
+  }
+  std::vector<Pixel> icon_pixels(total_pixels);
+  std::vector<ImageView> icons;
+  size_t offset = 0;
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    const uint32_t sz = sizes[i];
+    if (!resize[i]) {
+      // Embedded sizes are never read, so their view carries no pixels
+      icons.push_back(ImageView::interleaved(nullptr, sz, sz));
+      continue;
+    }
+    const PNGImage* pixels = chosen[i]->pixels();
+    if (!pixels) {
+      std::fprintf(stderr, "Failed to load image: %s\n", chosen[i]->name.c_str());
+      return false;
+    }
+    if (chosen[i] != &original) {
+      debug_log("Size %u uses a %ux%u source", sz, pixels->width, pixels->height);
+    }
+    ImageView source = ImageView::interleaved(pixels->pixels.data(), pixels->width, pixels->height);
+    ImageView resized = ImageView::interleaved(icon_pixels.data() + offset, sz, sz);
+    resize_nn(source, resized);
+    icons.push_back(resized);
+    offset += static_cast<size_t>(sz) * sz;
+  }
+
+#ifdef _DEBUG
+  namespace fs = std::filesystem;
+  fs::path debug_folder = "debug_images";
+  if (!fs::exists(debug_folder)) fs::create_directory(debug_folder);
+
+  char buf[128];
+  for (size_t i = 0; i < icons.size(); ++i) {
+    if (!icons[i].planes[0]) continue;
+    std::snprintf(buf, sizeof(buf), "debug_%u.png", sizes[i]);
+    fs::path debug_path = debug_folder / buf;
+
+    if (!write_png(debug_path.string(), icons[i])) {
+      std::fprintf(stderr, "Failed to write debug PNG: %s\n", debug_path.string().c_str());
+    }
+  }
+#endif
+
+  if (!job.update_sizes.empty()) {
+    if (!update_icns(job.output.c_str(), icons, options)) {
+      std::fprintf(stderr, "Failed to update ICNS: %s\n", job.output.c_str());
+      return false;
+    }
+    return true;
+  }
+  return write_targets(job.targets, icons, options);
+}
+
+// Sources after the main one are the --size files, one per entry; entries
+// naming the same file share its Source, so it is read and decoded once
+using SourceList = std::vector<std::shared_ptr<Source>>;
+
+static bool open_sources(const ConvertJob& job, SourceList& sources) {
+  if (!sources[0]->read_dimensions()) {
+    std::fprintf(stderr, "Failed to load image: %s\n", job.input.c_str());
+    return false;
+  }
+  for (const auto& entry : job.size_sources) {
+    auto same = std::find_if(sources.begin() + 1, sources.end(), [&](const std::shared_ptr<Source>& s) { return s->name == entry.second; });
+    if (same != sources.end()) {
+      sources.push_back(*same);
+      continue;
+    }
+    auto source = std::make_shared<Source>();
+    if (!source->load(entry.second) || !source->read_dimensions()) {
+      std::fprintf(stderr, "Failed to load image: %s\n", entry.second.c_str());
+      return false;
+    }
+    sources.push_back(std::move(source));
+  }
+  return true;
+}
+
+bool run_conversion(const ConvertJob& job, PayloadCache* cache) {
+  if (!job.input_data.empty()) {
+    return convert_data(job, job.input_data.data(), job.input_data.size(), cache);
+  }
+  SourceList sources = { std::make_shared<Source>() };
+  if (!sources[0]->load(job.input) || !open_sources(job, sources)) {
+    return false;
+  }
+  return convert_sources(job, sources, cache);
+}
+
+bool convert_data(const ConvertJob& job, const uint8_t* data, size_t size, PayloadCache* cache) {
+  SourceList sources = { std::make_shared<Source>() };
+  sources[0]->name = job.input;
+  sources[0]->data = data;
+  sources[0]->size = size;
+  if (!open_sources(job, sources)) {
+    return false;
+  }
+  return convert_sources(job, sources, cache);
+}
+
+std::string describe_result(const ConvertJob& job) {
+  if (!job.update_sizes.empty()) {
+    return "ICNS file updated successfully: " + job.output;
+  }
+  std::string text;
+  for (const OutputTarget& t : job.targets) {
+    if (!text.empty()) text += "\n";
+    text += std::string(container_name(t.container)) + " created successfully: " + t.path;
+  }
+  return text;
+}
@@ -1,26 +1,60 @@
 #include "crc.h"
 
-void make_crc_table() {
-  for (uint32_t n = 0; n < 256; n++) {
-    uint32_t c = n;
-    for (int k = 0; k < 8; k++) {
-      if (c & 1)
-        c = 0xedb88320L ^ (c >> 1);
-      else
-        c = c >> 1;
+// tables[0] is the classic byte-at-a-time table; tables[k][n] is the CRC of
+// byte n followed by k zero bytes, so eight bytes can be folded per lookup round
+struct CrcTables {
+  uint32_t t[8][256];
+
+  CrcTables() {
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++) {
+        if (c & 1)
+          c = 0xedb88320L ^ (c >> 1);
+        else
+          c = c >> 1;
+      }
+      t[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+      for (int k = 1; k < 8; k++) {
+        t[k][n] = (t[k - 1][n] >> 8) ^ t[0][t[k - 1][n] & 0xff];
+      }
     }
-    crc_table[n] = c;
   }
+};
+
+static const CrcTables& crc_tables() {
+  static const CrcTables tables;
+  return tables;
+}
+
+void make_crc_table() {
+  crc_tables();
+}
+
+static inline uint32_t load_le32(const uint8_t* p) {
+  return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+    (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
 }
 
 uint32_t update_crc(uint32_t crc, const uint8_t* buf, size_t len) {
+  const auto& t = crc_tables().t;
   uint32_t c = crc;
+  while (len >= 8) {
+    uint32_t one = load_le32(buf) ^ c;
+    uint32_t two = load_le32(buf + 4);
+    c = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^ t[5][(one >> 16) & 0xff] ^ t[4][one >> 24] ^
+      t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^ t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+    buf += 8;
+    len -= 8;
+  }
   for (size_t n = 0; n < len; n++) {
-    c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+    c = t[0][(c ^ buf[n]) & 0xff] ^ (c >> 8);
   }
   return c;
 }
 
 uint32_t crc(const uint8_t* buf, size_t len) {
   return update_crc(0xffffffff, buf, len) ^ 0xffffffff;
-}
\ No newline at end of file
+}
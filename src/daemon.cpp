@@ -0,0 +1,479 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#include <windows.h>
+#else
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "daemon.h"
+#include "convert.h"
+#include "cache.h"
+#include "utils.h"
+
+#ifdef _WIN32
+using socket_t = SOCKET;
+static const socket_t kInvalidSocket = INVALID_SOCKET;
+static void close_socket(socket_t s) { closesocket(s); }
+#else
+using socket_t = int;
+static const socket_t kInvalidSocket = -1;
+static void close_socket(socket_t s) { ::close(s); }
+#endif
+
+// Request sanity limits, so a confused client cannot make the server allocate wildly
+static const uint32_t kMaxArgs = 256;
+static const uint32_t kMaxArgLength = 64 * 1024;
+static const uint32_t kMaxInputLength = 256u << 20;
+// How long a connection may sit idle mid-request before its worker gives up on it
+static const uint32_t kSocketTimeoutSeconds = 30;
+// Resident payloads kept by the server between requests
+static const size_t kCacheMemoryLimit = 256u << 20;
+
+enum RequestKind : uint32_t { kConvert = 0, kStop = 1 };
+
+static bool init_sockets() {
+#ifdef _WIN32
+  static const bool ok = [] {
+    WSADATA data;
+    return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+  }();
+  if (!ok) {
+    std::fprintf(stderr, "Error: WSAStartup failed\n");
+  }
+  return ok;
+#else
+  // A client that disconnects early must not kill the process on the next send
+  std::signal(SIGPIPE, SIG_IGN);
+  return true;
+#endif
+}
+
+static bool make_address(const std::string& path, sockaddr_un& addr) {
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+    std::fprintf(stderr, "Error: Socket path must be 1-%zu bytes: %s\n", sizeof(addr.sun_path) - 1, path.c_str());
+    return false;
+  }
+  std::memcpy(addr.sun_path, path.c_str(), path.size());
+  return true;
+}
+
+// With report false, failing to connect is expected and not printed
+static socket_t connect_to(const std::string& path, bool report = true) {
+  sockaddr_un addr;
+  if (!init_sockets() || !make_address(path, addr)) {
+    return kInvalidSocket;
+  }
+  socket_t s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s == kInvalidSocket) {
+    std::fprintf(stderr, "Error: Cannot create socket\n");
+    return kInvalidSocket;
+  }
+  if (connect(s, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+    if (report) std::fprintf(stderr, "Error: Cannot connect to %s (is the server running?)\n", path.c_str());
+    close_socket(s);
+    return kInvalidSocket;
+  }
+  return s;
+}
+
+static void set_timeouts(socket_t s, uint32_t seconds) {
+#ifdef _WIN32
+  DWORD timeout = seconds * 1000;
+#else
+  timeval timeout{};
+  timeout.tv_sec = seconds;
+#endif
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+  setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+}
+
+// True for a Unix domain socket file (a reparse point on Windows)
+static bool is_socket_file(const std::string& path) {
+#ifdef _WIN32
+#ifndef IO_REPARSE_TAG_AF_UNIX
+#define IO_REPARSE_TAG_AF_UNIX 0x80000023L
+#endif
+  WIN32_FIND_DATAW data;
+  HANDLE h = FindFirstFileW(utf8_to_wide(path).c_str(), &data);
+  if (h == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  FindClose(h);
+  return (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) && data.dwReserved0 == IO_REPARSE_TAG_AF_UNIX;
+#else
+  std::error_code ec;
+  return std::filesystem::is_socket(std::filesystem::u8path(path), ec);
+#endif
+}
+
+static bool send_all(socket_t s, const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    int chunk = static_cast<int>(size < (1u << 30) ? size : (1u << 30));
+    int sent = send(s, p, chunk, 0);
+    if (sent <= 0) {
+#ifndef _WIN32
+      if (sent < 0 && errno == EINTR) continue;
+#endif
+      return false;
+    }
+    p += sent;
+    size -= static_cast<size_t>(sent);
+  }
+  return true;
+}
+
+static bool recv_all(socket_t s, void* data, size_t size) {
+  char* p = static_cast<char*>(data);
+  while (size > 0) {
+    int chunk = static_cast<int>(size < (1u << 30) ? size : (1u << 30));
+    int got = recv(s, p, chunk, 0);
+    if (got <= 0) {
+#ifndef _WIN32
+      if (got < 0 && errno == EINTR) continue;
+#endif
+      return false;
+    }
+    p += got;
+    size -= static_cast<size_t>(got);
+  }
+  return true;
+}
+
+static bool send_u32(socket_t s, uint32_t value) {
+  uint8_t buf[4];
+  write_be_uint32(buf, value);
+  return send_all(s, buf, 4);
+}
+
+static bool recv_u32(socket_t s, uint32_t& value) {
+  uint8_t buf[4];
+  if (!recv_all(s, buf, 4)) return false;
+  value = read_be_uint32(buf);
+  return true;
+}
+
+static bool send_blob(socket_t s, const void* data, size_t size) {
+  return send_u32(s, static_cast<uint32_t>(size)) && (size == 0 || send_all(s, data, size));
+}
+
+static bool recv_blob(socket_t s, uint32_t limit, std::vector<uint8_t>& out) {
+  uint32_t size;
+  if (!recv_u32(s, size) || size > limit) return false;
+  out.resize(size);
+  return size == 0 || recv_all(s, out.data(), size);
+}
+
+static bool send_request(socket_t s, RequestKind kind, const std::vector<std::string>& args, const std::vector<uint8_t>& input) {
+  if (!send_all(s, "ICV1", 4) || !send_u32(s, kind) || !send_u32(s, static_cast<uint32_t>(args.size()))) {
+    return false;
+  }
+  for (const std::string& a : args) {
+    if (!send_blob(s, a.data(), a.size())) return false;
+  }
+  return send_blob(s, input.data(), input.size());
+}
+
+// Reads the server's reply, prints its message and returns the exit code
+static int read_response(socket_t s) {
+  uint32_t status;
+  std::vector<uint8_t> message;
+  if (!recv_u32(s, status) || !recv_blob(s, kMaxArgLength, message)) {
+    std::fprintf(stderr, "Error: No response from server\n");
+    return 1;
+  }
+  std::fprintf(status == 0 ? stdout : stderr, "%.*s\n", static_cast<int>(message.size()), reinterpret_cast<const char*>(message.data()));
+  return status == 0 ? 0 : 1;
+}
+
+namespace {
+
+struct Server {
+  socket_t listener = kInvalidSocket;
+  std::string path;
+  PayloadCache* cache = nullptr;
+
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<socket_t> pending;
+  bool stopping = false;
+
+  // Handles one connection; returns true when it asked the server to stop.
+  // Nothing a request does (a huge image, running out of memory) may take the
+  // server down, so failures are caught here and reported to the client.
+  bool handle(socket_t s) {
+    try {
+      return serve(s);
+    }
+    catch (const std::exception& e) {
+      std::fprintf(stderr, "Error: Request failed: %s\n", e.what());
+      reply(s, 1, std::string("Request failed: ") + e.what());
+      return false;
+    }
+  }
+
+  bool serve(socket_t s) {
+    char magic[4];
+    uint32_t kind = 0, count = 0;
+    if (!recv_all(s, magic, 4) || std::memcmp(magic, "ICV1", 4) != 0 ||
+      !recv_u32(s, kind) || !recv_u32(s, count) || count > kMaxArgs) {
+      reply(s, 1, "Malformed request");
+      return false;
+    }
+    std::vector<std::string> args;
+    for (uint32_t i = 0; i < count; ++i) {
+      std::vector<uint8_t> arg;
+      if (!recv_blob(s, kMaxArgLength, arg)) {
+        reply(s, 1, "Malformed request");
+        return false;
+      }
+      args.emplace_back(arg.begin(), arg.end());
+    }
+    ConvertJob job;
+    if (!recv_blob(s, kMaxInputLength, job.input_data)) {
+      reply(s, 1, "Malformed request");
+      return false;
+    }
+
+    if (kind == kStop) {
+      reply(s, 0, "Server stopping");
+      return true;
+    }
+    if (!parse_convert_args(args, job)) {
+      reply(s, 1, "Invalid arguments (see server log)");
+      return false;
+    }
+    if (!job.cache_dir.empty()) {
+      reply(s, 1, "--cache is a server option; start the server with it instead");
+      return false;
+    }
+    if (job.watch) {
+      reply(s, 1, "--watch is not available through the server");
+      return false;
+    }
+    if (std::any_of(job.targets.begin(), job.targets.end(), [](const OutputTarget& t) { return is_stdio_path(t.path); })) {
+      reply(s, 1, "The server cannot write to the client's standard output");
+      return false;
+    }
+    if (is_stdio_path(job.input) && job.input_data.empty()) {
+      reply(s, 1, "The server cannot read the client's standard input; send the input instead");
+      return false;
+    }
+
+    debug_log("server: converting %s to %s", job.input.c_str(), job.output.c_str());
+    if (!run_conversion(job, cache)) {
+      reply(s, 1, "Failed to convert " + job.input + " (see server log)");
+      return false;
+    }
+    reply(s, 0, describe_result(job));
+    return false;
+  }
+
+  static void reply(socket_t s, uint32_t status, const std::string& message) {
+    if (send_u32(s, status)) {
+      send_blob(s, message.data(), message.size());
+    }
+  }
+
+  void worker() {
+    while (true) {
+      socket_t s;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [&] { return stopping || !pending.empty(); });
+        if (pending.empty()) {
+          return; // Stopping and the queue is drained
+        }
+        s = pending.front();
+        pending.pop_front();
+      }
+
+      bool stop = handle(s);
+      close_socket(s);
+      if (stop) {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          stopping = true;
+        }
+        ready.notify_all();
+        // Wake the acceptor, which is blocked in accept()
+        socket_t wake = connect_to(path);
+        if (wake != kInvalidSocket) close_socket(wake);
+      }
+    }
+  }
+};
+
+} // namespace
+
+int run_server(const std::string& socket_path, const std::string& cache_dir, unsigned workers) {
+  sockaddr_un addr;
+  if (!init_sockets() || !make_address(socket_path, addr)) {
+    return 1;
+  }
+
+  Server server;
+  server.path = socket_path;
+  server.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server.listener == kInvalidSocket) {
+    std::fprintf(stderr, "Error: Cannot create socket\n");
+    return 1;
+  }
+  // A socket file left behind by a server that did not shut down cleanly blocks
+  // bind(). Only a dead socket is removed: never a regular file, and never the
+  // socket of a server that still answers.
+  std::error_code ec;
+  if (std::filesystem::exists(std::filesystem::u8path(socket_path), ec)) {
+    if (!is_socket_file(socket_path)) {
+      std::fprintf(stderr, "Error: %s exists and is not a socket\n", socket_path.c_str());
+      close_socket(server.listener);
+      return 1;
+    }
+    socket_t live = connect_to(socket_path, false);
+    if (live != kInvalidSocket) {
+      close_socket(live);
+      std::fprintf(stderr, "Error: A server is already listening on %s\n", socket_path.c_str());
+      close_socket(server.listener);
+      return 1;
+    }
+    std::filesystem::remove(std::filesystem::u8path(socket_path), ec);
+  }
+  if (bind(server.listener, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 ||
+    listen(server.listener, 64) != 0) {
+    std::fprintf(stderr, "Error: Cannot listen on %s\n", socket_path.c_str());
+    close_socket(server.listener);
+    return 1;
+  }
+
+  PayloadCache cache(cache_dir);
+  cache.set_memory_limit(kCacheMemoryLimit);
+  server.cache = &cache;
+
+  if (workers == 0) {
+    workers = std::max(1u, std::thread::hardware_concurrency());
+  }
+  std::vector<std::thread> pool;
+  for (unsigned i = 0; i < workers; ++i) {
+    pool.emplace_back(&Server::worker, &server);
+  }
+  std::printf("Listening on %s with %u workers\n", socket_path.c_str(), workers);
+  std::fflush(stdout);
+
+  while (true) {
+    socket_t client = accept(server.listener, nullptr, nullptr);
+    std::lock_guard<std::mutex> lock(server.mutex);
+    if (server.stopping) {
+      if (client != kInvalidSocket) close_socket(client);
+      break;
+    }
+    if (client == kInvalidSocket) {
+      continue; // Interrupted or aborted connection
+    }
+    set_timeouts(client, kSocketTimeoutSeconds);
+    server.pending.push_back(client);
+    server.ready.notify_one();
+  }
+
+  for (auto& t : pool) {
+    t.join();
+  }
+  close_socket(server.listener);
+  std::filesystem::remove(std::filesystem::u8path(socket_path), ec);
+  std::printf("Server stopped (%zu cache hits, %zu misses)\n", cache.hits(), cache.misses());
+  return 0;
+}
+
+int run_client(const std::string& socket_path, const std::vector<std::string>& args, bool send_input) {
+  if (args.size() < 2) {
+    std::fprintf(stderr, "Error: Expected an input and an output file\n");
+    return 1;
+  }
+
+  // The server has its own working directory
+  namespace fs = std::filesystem;
+  std::vector<std::string> request = args;
+  for (size_t i = 0; i < args.size(); ++i) {
+    if (is_stdio_path(args[i])) continue;
+    std::error_code ec;
+    if (i >= 2 && args[i - 1] == "--size") {
+      // size=file
+      size_t eq = args[i].find('=');
+      fs::path p = fs::absolute(fs::u8path(args[i].substr(eq + 1)), ec);
+      if (eq != std::string::npos && !ec) request[i] = args[i].substr(0, eq + 1) + p.u8string();
+      continue;
+    }
+    if (i >= 2 && args[i - 1] != "--output" && args[i - 1] != "--profile") continue;
+    fs::path p = fs::absolute(fs::u8path(args[i]), ec);
+    if (!ec) request[i] = p.u8string();
+  }
+
+  std::vector<uint8_t> input;
+  if (is_stdio_path(args[0])) {
+    // Standard input can only reach the server as bytes
+    if (!read_stdin(input)) {
+      return 1;
+    }
+    if (input.size() > kMaxInputLength) {
+      std::fprintf(stderr, "Error: Standard input is too large to send\n");
+      return 1;
+    }
+  }
+  else if (send_input) {
+    std::ifstream in(fs::u8path(args[0]), std::ios::binary);
+    if (!in) {
+      std::fprintf(stderr, "Error: Cannot open file %s\n", args[0].c_str());
+      return 1;
+    }
+    input.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    if (input.empty() || input.size() > kMaxInputLength) {
+      std::fprintf(stderr, "Error: %s is empty or too large to send\n", args[0].c_str());
+      return 1;
+    }
+  }
+
+  socket_t s = connect_to(socket_path);
+  if (s == kInvalidSocket) {
+    return 1;
+  }
+  int result = 1;
+  if (send_request(s, kConvert, request, input)) {
+    result = read_response(s);
+  }
+  else {
+    std::fprintf(stderr, "Error: Failed to send request to %s\n", socket_path.c_str());
+  }
+  close_socket(s);
+  return result;
+}
+
+int stop_server(const std::string& socket_path) {
+  socket_t s = connect_to(socket_path);
+  if (s == kInvalidSocket) {
+    return 1;
+  }
+  int result = send_request(s, kStop, {}, {}) ? read_response(s) : 1;
+  close_socket(s);
+  return result;
+}
@@ -0,0 +1,52 @@
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "decoder.h"
+#include "jpg.h"
+
+static bool sniff_png(const uint8_t* data, size_t size) {
+  return size >= 8 && std::memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0;
+}
+
+static bool decode_png_source(const uint8_t* data, size_t size, const std::string& source, PNGImage& out) {
+  return decode_png(data, size, out, source);
+}
+
+// SOI marker followed by the start of the next marker
+static bool sniff_jpeg(const uint8_t* data, size_t size) {
+  return size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF;
+}
+
+static std::vector<ImageDecoder>& decoders() {
+  static std::vector<ImageDecoder> list = {
+    { "PNG", sniff_png, decode_png_source },
+    { "JPEG", sniff_jpeg, decode_jpeg },
+  };
+  return list;
+}
+
+void register_decoder(const ImageDecoder& decoder) {
+  decoders().push_back(decoder);
+}
+
+const ImageDecoder* find_decoder(const uint8_t* data, size_t size) {
+  for (const ImageDecoder& d : decoders()) {
+    if (d.sniff(data, size)) {
+      return &d;
+    }
+  }
+  return nullptr;
+}
+
+bool decode_image(const uint8_t* data, size_t size, const std::string& source, PNGImage& out) {
+  const ImageDecoder* decoder = find_decoder(data, size);
+  if (!decoder) {
+    std::fprintf(stderr, "Error: %s is not in a supported image format\n", source.c_str());
+    return false;
+  }
+  if (!decoder->decode(data, size, source, out)) {
+    std::fprintf(stderr, "Error: Failed to decode %s image %s (possible corruption or unsupported variant)\n", decoder->name, source.c_str());
+    return false;
+  }
+  return true;
+}
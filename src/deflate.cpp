@@ -0,0 +1,631 @@
+#include <algorithm>
+#include <cstring>
+#include <zlib.h>
+#include "deflate.h"
+#include "arena.h"
+#include "utils.h"
+
+static const size_t kWindowSize = 32768;
+static const size_t kMinMatch = 3;
+static const size_t kMaxMatch = 258;
+
+// Search effort. Small icons are searched exhaustively since they cost next to
+// nothing; large ones trade a little ratio for speed.
+struct SearchParams {
+  int max_chain;      // Hash chain candidates examined per position
+  size_t nice_length; // Stop searching once a match is this long
+  size_t lazy_length; // Try one position later for matches shorter than this
+};
+static const SearchParams kSmallSearch = { 1024, 258, 258 };
+static const SearchParams kLargeSearch = { 48, 128, 32 };
+static const size_t kSmallInput = 65536;
+static const size_t kBlockSymbols = 16384;
+
+static const int kLitLenCodes = 286;
+static const int kDistCodes = 30;
+static const int kCodeLenCodes = 19;
+
+static const uint16_t len_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t len_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t code_len_order[kCodeLenCodes] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static uint16_t reverse_bits(uint16_t code, int bits) {
+  uint16_t r = 0;
+  for (int i = 0; i < bits; ++i) {
+    r = static_cast<uint16_t>((r << 1) | (code & 1));
+    code >>= 1;
+  }
+  return r;
+}
+
+// Canonical codes from code lengths, bit-reversed for LSB-first output
+static void build_codes(const uint8_t* lengths, int n, uint16_t* codes) {
+  uint16_t count[16] = { 0 };
+  uint16_t next[16] = { 0 };
+  for (int i = 0; i < n; ++i) count[lengths[i]]++;
+  count[0] = 0;
+  uint16_t code = 0;
+  for (int bits = 1; bits < 16; ++bits) {
+    code = static_cast<uint16_t>((code + count[bits - 1]) << 1);
+    next[bits] = code;
+  }
+  for (int i = 0; i < n; ++i) {
+    codes[i] = lengths[i] ? reverse_bits(next[lengths[i]]++, lengths[i]) : 0;
+  }
+}
+
+// Lookup tables shared by every call, built once
+struct DeflateTables {
+  uint8_t length_code[kMaxMatch + 1];
+  uint8_t dist_code[512];
+  uint8_t fixed_lit_len[288];
+  uint16_t fixed_lit_code[288];
+  uint8_t fixed_dist_len[kDistCodes];
+  uint16_t fixed_dist_code[kDistCodes];
+
+  DeflateTables() {
+    for (int c = 0; c < 29; ++c) {
+      for (int l = len_base[c]; l < len_base[c] + (1 << len_extra[c]) && l <= (int)kMaxMatch; ++l) {
+        length_code[l] = static_cast<uint8_t>(c);
+      }
+    }
+    length_code[kMaxMatch] = 28;
+
+    // Distances up to 256 index directly; larger ones by (dist - 1) >> 7, as in zlib
+    for (int c = 0; c < 16; ++c) {
+      for (int k = 0; k < (1 << dist_extra[c]); ++k) dist_code[dist_base[c] - 1 + k] = static_cast<uint8_t>(c);
+    }
+    for (int c = 16; c < kDistCodes; ++c) {
+      for (int k = 0; k < (1 << (dist_extra[c] - 7)); ++k) dist_code[256 + ((dist_base[c] - 1) >> 7) + k] = static_cast<uint8_t>(c);
+    }
+
+    for (int i = 0; i < 288; ++i) {
+      fixed_lit_len[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    }
+    build_codes(fixed_lit_len, 288, fixed_lit_code);
+    for (int i = 0; i < kDistCodes; ++i) fixed_dist_len[i] = 5;
+    build_codes(fixed_dist_len, kDistCodes, fixed_dist_code);
+  }
+
+  int distance_code(size_t dist) const {
+    return dist <= 256 ? dist_code[dist - 1] : dist_code[256 + ((dist - 1) >> 7)];
+  }
+};
+
+static const DeflateTables& tables() {
+  static const DeflateTables t;
+  return t;
+}
+
+// Huffman code lengths limited to max_bits. Lengths follow the optimal tree,
+// then the overflow is pushed down the same way miniz does it.
+static void build_lengths(const uint32_t* freq, int n, int max_bits, uint8_t* lengths) {
+  std::memset(lengths, 0, n);
+  int symbols[kLitLenCodes];
+  int count = 0;
+  for (int i = 0; i < n; ++i) {
+    if (freq[i]) symbols[count++] = i;
+  }
+  if (count == 0) {
+    return;
+  }
+  if (count == 1) {
+    lengths[symbols[0]] = 1;
+    return;
+  }
+  std::sort(symbols, symbols + count, [&](int a, int b) { return freq[a] != freq[b] ? freq[a] < freq[b] : a < b; });
+
+  // Two-queue Huffman construction: leaves 0..count-1 (ascending), internal nodes after
+  uint64_t weight[2 * kLitLenCodes];
+  int parent[2 * kLitLenCodes];
+  for (int i = 0; i < count; ++i) weight[i] = freq[symbols[i]];
+  int leaf = 0, node = count, next = count;
+  auto take = [&]() {
+    if (leaf < count && (node >= next || weight[leaf] <= weight[node])) return leaf++;
+    return node++;
+  };
+  while (next < 2 * count - 1) {
+    int a = take();
+    int b = take();
+    weight[next] = weight[a] + weight[b];
+    parent[a] = next;
+    parent[b] = next;
+    next++;
+  }
+
+  int depth[2 * kLitLenCodes];
+  depth[2 * count - 2] = 0;
+  for (int i = 2 * count - 3; i >= 0; --i) depth[i] = depth[parent[i]] + 1;
+
+  int num[64] = { 0 };
+  for (int i = 0; i < count; ++i) num[std::min(depth[i], 63)]++;
+  for (int i = max_bits + 1; i < 64; ++i) {
+    num[max_bits] += num[i];
+  }
+  uint32_t total = 0;
+  for (int i = max_bits; i > 0; --i) total += static_cast<uint32_t>(num[i]) << (max_bits - i);
+  while (total != (1u << max_bits)) {
+    num[max_bits]--;
+    for (int i = max_bits - 1; i > 0; --i) {
+      if (num[i]) {
+        num[i]--;
+        num[i + 1] += 2;
+        break;
+      }
+    }
+    total--;
+  }
+
+  // Least frequent symbols get the longest codes
+  int idx = 0;
+  for (int bits = max_bits; bits > 0; --bits) {
+    for (int k = 0; k < num[bits]; ++k) lengths[symbols[idx++]] = static_cast<uint8_t>(bits);
+  }
+}
+
+// zlib rejects incomplete code sets, so every code gets at least two symbols
+static void ensure_two_symbols(uint32_t* freq, int n) {
+  int used = 0;
+  for (int i = 0; i < n && used < 2; ++i) used += freq[i] != 0;
+  for (int i = 0; i < n && used < 2; ++i) {
+    if (!freq[i]) {
+      freq[i] = 1;
+      used++;
+    }
+  }
+}
+
+struct BitWriter {
+  uint8_t* out;
+  size_t capacity;
+  size_t pos = 0;
+  uint64_t bits = 0;
+  int count = 0;
+  bool overflow = false;
+
+  void put(uint32_t value, int n) {
+    bits |= static_cast<uint64_t>(value) << count;
+    count += n;
+    if (count >= 32) {
+      if (capacity - pos < 4) {
+        overflow = true;
+        pos = capacity;
+      }
+      else {
+        out[pos] = static_cast<uint8_t>(bits);
+        out[pos + 1] = static_cast<uint8_t>(bits >> 8);
+        out[pos + 2] = static_cast<uint8_t>(bits >> 16);
+        out[pos + 3] = static_cast<uint8_t>(bits >> 24);
+        pos += 4;
+      }
+      bits >>= 32;
+      count -= 32;
+    }
+  }
+
+  // Pads to a byte boundary and flushes every pending byte
+  void align() {
+    while (count > 0) {
+      if (pos < capacity) out[pos++] = static_cast<uint8_t>(bits);
+      else overflow = true;
+      bits >>= 8;
+      count = count > 8 ? count - 8 : 0;
+    }
+    bits = 0;
+  }
+
+  void bytes(const uint8_t* data, size_t n) {
+    if (capacity - pos < n) {
+      overflow = true;
+      pos = capacity;
+      return;
+    }
+    std::memcpy(out + pos, data, n);
+    pos += n;
+  }
+};
+
+// A literal (dist == 0) or a length/distance pair
+struct Symbol {
+  uint16_t lit_len;
+  uint16_t dist;
+};
+
+class BlockEncoder {
+public:
+  BlockEncoder(const uint8_t* src, BitWriter& bw, Symbol* symbols) : src_(src), bw_(bw), symbols_(symbols) {
+    clear();
+  }
+
+  size_t size() const { return count_; }
+
+  void literal(uint8_t c) {
+    symbols_[count_++] = Symbol{ c, 0 };
+    lit_freq_[c]++;
+  }
+
+  void match(size_t length, size_t dist) {
+    const DeflateTables& t = tables();
+    symbols_[count_++] = Symbol{ static_cast<uint16_t>(length), static_cast<uint16_t>(dist) };
+    lit_freq_[257 + t.length_code[length]]++;
+    dist_freq_[t.distance_code(dist)]++;
+  }
+
+  // Emits src[start, end) as one block using whichever coding is smallest
+  void flush(size_t start, size_t end, bool final) {
+    const DeflateTables& t = tables();
+    lit_freq_[256] = 1;
+
+    uint64_t extra_bits = 0;
+    for (int c = 0; c < 29; ++c) extra_bits += static_cast<uint64_t>(lit_freq_[257 + c]) * len_extra[c];
+    for (int c = 0; c < kDistCodes; ++c) extra_bits += static_cast<uint64_t>(dist_freq_[c]) * dist_extra[c];
+
+    uint64_t fixed_bits = 3 + extra_bits;
+    for (int i = 0; i < kLitLenCodes; ++i) fixed_bits += static_cast<uint64_t>(lit_freq_[i]) * t.fixed_lit_len[i];
+    for (int i = 0; i < kDistCodes; ++i) fixed_bits += static_cast<uint64_t>(dist_freq_[i]) * 5;
+
+    uint64_t dynamic_bits = 3 + extra_bits + build_dynamic();
+    for (int i = 0; i < kLitLenCodes; ++i) dynamic_bits += static_cast<uint64_t>(lit_freq_[i]) * lit_len_[i];
+    for (int i = 0; i < kDistCodes; ++i) dynamic_bits += static_cast<uint64_t>(dist_freq_[i]) * dist_len_[i];
+
+    // Stored: header and padding to a byte, then LEN/NLEN per 64K piece
+    const size_t raw = end - start;
+    const size_t pieces = raw == 0 ? 1 : (raw + 65534) / 65535;
+    uint64_t stored_bits = pieces * (3 + 7 + 32) + static_cast<uint64_t>(raw) * 8;
+
+    if (stored_bits < fixed_bits && stored_bits < dynamic_bits) {
+      write_stored(start, end, final);
+    }
+    else if (fixed_bits <= dynamic_bits) {
+      bw_.put(final ? 1 : 0, 1);
+      bw_.put(1, 2);
+      write_symbols(t.fixed_lit_len, t.fixed_lit_code, t.fixed_dist_len, t.fixed_dist_code);
+    }
+    else {
+      bw_.put(final ? 1 : 0, 1);
+      bw_.put(2, 2);
+      write_dynamic_header();
+      write_symbols(lit_len_, lit_code_, dist_len_, dist_code_);
+    }
+    clear();
+  }
+
+private:
+  void clear() {
+    count_ = 0;
+    std::memset(lit_freq_, 0, sizeof(lit_freq_));
+    std::memset(dist_freq_, 0, sizeof(dist_freq_));
+  }
+
+  // Builds the dynamic code and its run-length encoded description;
+  // returns the header size in bits
+  uint64_t build_dynamic() {
+    uint32_t lit_freq[kLitLenCodes];
+    uint32_t dist_freq[kDistCodes];
+    std::memcpy(lit_freq, lit_freq_, sizeof(lit_freq));
+    std::memcpy(dist_freq, dist_freq_, sizeof(dist_freq));
+    ensure_two_symbols(lit_freq, kLitLenCodes);
+    ensure_two_symbols(dist_freq, kDistCodes);
+    build_lengths(lit_freq, kLitLenCodes, 15, lit_len_);
+    build_lengths(dist_freq, kDistCodes, 15, dist_len_);
+    build_codes(lit_len_, kLitLenCodes, lit_code_);
+    build_codes(dist_len_, kDistCodes, dist_code_);
+
+    hlit_ = kLitLenCodes;
+    while (hlit_ > 257 && lit_len_[hlit_ - 1] == 0) hlit_--;
+    hdist_ = kDistCodes;
+    while (hdist_ > 1 && dist_len_[hdist_ - 1] == 0) hdist_--;
+
+    uint8_t all[kLitLenCodes + kDistCodes];
+    std::memcpy(all, lit_len_, hlit_);
+    std::memcpy(all + hlit_, dist_len_, hdist_);
+    const int total = hlit_ + hdist_;
+
+    // Run-length encode the code lengths with symbols 16 (repeat), 17 and 18 (zeros)
+    item_count_ = 0;
+    for (int i = 0; i < total; ) {
+      uint8_t value = all[i];
+      int run = 1;
+      while (i + run < total && all[i + run] == value) run++;
+      i += run;
+      if (value == 0) {
+        while (run >= 11) {
+          int n = std::min(run, 138);
+          add_item(18, n - 11);
+          run -= n;
+        }
+        if (run >= 3) {
+          add_item(17, run - 3);
+          run = 0;
+        }
+      }
+      else {
+        add_item(value, 0);
+        run--;
+        while (run >= 3) {
+          int n = std::min(run, 6);
+          add_item(16, n - 3);
+          run -= n;
+        }
+      }
+      while (run-- > 0) add_item(value, 0);
+    }
+
+    uint32_t cl_freq[kCodeLenCodes] = { 0 };
+    for (int i = 0; i < item_count_; ++i) cl_freq[items_[i].symbol]++;
+    ensure_two_symbols(cl_freq, kCodeLenCodes);
+    build_lengths(cl_freq, kCodeLenCodes, 7, cl_len_);
+    build_codes(cl_len_, kCodeLenCodes, cl_code_);
+
+    hclen_ = kCodeLenCodes;
+    while (hclen_ > 4 && cl_len_[code_len_order[hclen_ - 1]] == 0) hclen_--;
+
+    uint64_t bits = 5 + 5 + 4 + 3 * static_cast<uint64_t>(hclen_);
+    for (int i = 0; i < item_count_; ++i) {
+      uint8_t s = items_[i].symbol;
+      bits += cl_len_[s] + (s == 16 ? 2 : s == 17 ? 3 : s == 18 ? 7 : 0);
+    }
+    return bits;
+  }
+
+  void add_item(uint8_t symbol, int extra) {
+    items_[item_count_++] = Item{ symbol, static_cast<uint8_t>(extra) };
+  }
+
+  void write_dynamic_header() {
+    bw_.put(hlit_ - 257, 5);
+    bw_.put(hdist_ - 1, 5);
+    bw_.put(hclen_ - 4, 4);
+    for (int i = 0; i < hclen_; ++i) bw_.put(cl_len_[code_len_order[i]], 3);
+    for (int i = 0; i < item_count_; ++i) {
+      uint8_t s = items_[i].symbol;
+      bw_.put(cl_code_[s], cl_len_[s]);
+      if (s == 16) bw_.put(items_[i].extra, 2);
+      else if (s == 17) bw_.put(items_[i].extra, 3);
+      else if (s == 18) bw_.put(items_[i].extra, 7);
+    }
+  }
+
+  void write_symbols(const uint8_t* lit_len, const uint16_t* lit_code, const uint8_t* dist_len, const uint16_t* dist_code) {
+    const DeflateTables& t = tables();
+    for (size_t i = 0; i < count_; ++i) {
+      const Symbol& s = symbols_[i];
+      if (s.dist == 0) {
+        bw_.put(lit_code[s.lit_len], lit_len[s.lit_len]);
+        continue;
+      }
+      int lc = t.length_code[s.lit_len];
+      bw_.put(lit_code[257 + lc], lit_len[257 + lc]);
+      if (len_extra[lc]) bw_.put(s.lit_len - len_base[lc], len_extra[lc]);
+      int dc = t.distance_code(s.dist);
+      bw_.put(dist_code[dc], dist_len[dc]);
+      if (dist_extra[dc]) bw_.put(s.dist - dist_base[dc], dist_extra[dc]);
+    }
+    bw_.put(lit_code[256], lit_len[256]);
+  }
+
+  void write_stored(size_t start, size_t end, bool final) {
+    do {
+      size_t n = std::min<size_t>(end - start, 65535);
+      bool last = start + n == end;
+      bw_.put(final && last ? 1 : 0, 1);
+      bw_.put(0, 2);
+      bw_.align();
+      uint8_t header[4] = { static_cast<uint8_t>(n), static_cast<uint8_t>(n >> 8),
+        static_cast<uint8_t>(~n), static_cast<uint8_t>(~n >> 8) };
+      bw_.bytes(header, 4);
+      bw_.bytes(src_ + start, n);
+      start += n;
+    } while (start < end);
+  }
+
+  struct Item {
+    uint8_t symbol;
+    uint8_t extra;
+  };
+
+  const uint8_t* src_;
+  BitWriter& bw_;
+  Symbol* symbols_;
+  size_t count_ = 0;
+  uint32_t lit_freq_[kLitLenCodes];
+  uint32_t dist_freq_[kDistCodes];
+
+  uint8_t lit_len_[kLitLenCodes];
+  uint16_t lit_code_[kLitLenCodes];
+  uint8_t dist_len_[kDistCodes];
+  uint16_t dist_code_[kDistCodes];
+  uint8_t cl_len_[kCodeLenCodes];
+  uint16_t cl_code_[kCodeLenCodes];
+  Item items_[kLitLenCodes + kDistCodes];
+  int item_count_ = 0;
+  int hlit_ = 0, hdist_ = 0, hclen_ = 0;
+};
+
+static size_t match_length(const uint8_t* a, const uint8_t* b, size_t max_len) {
+  size_t n = 0;
+  while (n + 4 <= max_len) {
+    uint32_t x, y;
+    std::memcpy(&x, a + n, 4);
+    std::memcpy(&y, b + n, 4);
+    if (x != y) break;
+    n += 4;
+  }
+  while (n < max_len && a[n] == b[n]) ++n;
+  return n;
+}
+
+// LZ77 matcher with hash chains over 4-byte groups (one RGBA pixel)
+class Matcher {
+public:
+  Matcher(const uint8_t* src, size_t len, size_t pixel_bytes, size_t row_bytes, const SearchParams& params, int hash_bits, uint32_t* head, uint32_t* prev)
+    : src_(src), len_(len), params_(params), hash_bits_(hash_bits), head_(head), prev_(prev) {
+    probes_[0] = pixel_bytes;
+    probes_[1] = 1;
+    probes_[2] = row_bytes;
+    std::memset(head_, 0, sizeof(uint32_t) << hash_bits_);
+  }
+
+  // Best match at pos among earlier positions; length 0 if none reaches kMinMatch
+  void find(size_t pos, size_t& best_len, size_t& best_dist) const {
+    best_len = 0;
+    best_dist = 0;
+    const size_t avail = std::min(kMaxMatch, len_ - pos);
+    if (avail < kMinMatch) {
+      return;
+    }
+    const uint8_t* cur = src_ + pos;
+
+    // Flat regions and vertical repeats are found without touching the chains
+    for (size_t d : probes_) {
+      if (d == 0 || d > pos || d > kWindowSize) continue;
+      size_t l = match_length(cur, cur - d, avail);
+      if (l > best_len) {
+        best_len = l;
+        best_dist = d;
+      }
+    }
+    if (best_len >= params_.nice_length || best_len == avail || avail < 4) {
+      if (best_len < kMinMatch) best_len = 0;
+      return;
+    }
+
+    uint32_t first4;
+    std::memcpy(&first4, cur, 4);
+    uint32_t cand = head_[hash(cur)];
+    for (int chain = params_.max_chain; cand != 0 && chain > 0; --chain) {
+      size_t c = cand - 1;
+      size_t dist = pos - c;
+      if (c >= pos || dist > kWindowSize) break;
+      // Chains share hash buckets: reject on the first pixel, then on the byte
+      // that would have to extend the best match
+      uint32_t cand4;
+      std::memcpy(&cand4, src_ + c, 4);
+      if (cand4 == first4 && src_[c + best_len] == cur[best_len]) {
+        size_t l = match_length(cur, src_ + c, avail);
+        if (l > best_len) {
+          best_len = l;
+          best_dist = dist;
+          if (l >= params_.nice_length || l == avail) break;
+        }
+      }
+      cand = prev_[c & (kWindowSize - 1)];
+    }
+    if (best_len < kMinMatch) best_len = 0;
+  }
+
+  // Adds positions [next_, end) to the chains
+  void insert_until(size_t end) {
+    if (end + 4 > len_) end = len_ >= 4 ? len_ - 3 : 0;
+    for (; next_ < end; ++next_) {
+      uint32_t h = hash(src_ + next_);
+      prev_[next_ & (kWindowSize - 1)] = head_[h];
+      head_[h] = static_cast<uint32_t>(next_ + 1);
+    }
+  }
+
+  // Skips the middle of a long run, whose positions only repeat one hash
+  void skip_to(size_t pos) {
+    if (pos > next_) next_ = pos;
+  }
+
+private:
+  uint32_t hash(const uint8_t* p) const {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - hash_bits_);
+  }
+
+  const uint8_t* src_;
+  size_t len_;
+  SearchParams params_;
+  int hash_bits_;
+  uint32_t* head_;
+  uint32_t* prev_;
+  size_t probes_[3];
+  size_t next_ = 0;
+};
+
+size_t builtin_deflate(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_capacity, size_t pixel_bytes, size_t row_bytes) {
+  if (dst_capacity < 6) {
+    return 0;
+  }
+
+  // Small icons get small hash tables, so clearing them costs next to nothing
+  int hash_bits = 8;
+  while (hash_bits < 15 && (size_t(1) << hash_bits) < len) hash_bits++;
+
+  ScratchLease scratch;
+  uint32_t* head = scratch->allocate_array<uint32_t>(size_t(1) << hash_bits);
+  uint32_t* prev = scratch->allocate_array<uint32_t>(kWindowSize);
+  Symbol* symbols = scratch->allocate_array<Symbol>(kBlockSymbols);
+  if (!head || !prev || !symbols) {
+    return 0;
+  }
+
+  // zlib header: deflate, 32K window, maximum compression
+  dst[0] = 0x78;
+  dst[1] = 0xDA;
+  BitWriter bw{ dst + 2, dst_capacity - 6 };
+
+  const SearchParams& params = len <= kSmallInput ? kSmallSearch : kLargeSearch;
+  Matcher matcher(src, len, pixel_bytes, row_bytes, params, hash_bits, head, prev);
+  BlockEncoder block(src, bw, symbols);
+  size_t block_start = 0;
+  size_t pos = 0;
+  size_t cur_len = 0, cur_dist = 0;
+  if (len > 0) matcher.find(0, cur_len, cur_dist);
+  matcher.insert_until(1);
+
+  while (pos < len && !bw.overflow) {
+    if (block.size() >= kBlockSymbols - 1) {
+      block.flush(block_start, pos, false);
+      block_start = pos;
+    }
+
+    if (cur_len == 0) {
+      block.literal(src[pos]);
+      pos++;
+      if (pos < len) matcher.find(pos, cur_len, cur_dist);
+      matcher.insert_until(pos + 1);
+      continue;
+    }
+
+    // One-step lazy evaluation: a longer match at the next byte wins
+    if (cur_len < params.lazy_length && pos + 1 < len) {
+      size_t next_len, next_dist;
+      matcher.find(pos + 1, next_len, next_dist);
+      matcher.insert_until(pos + 2);
+      if (next_len > cur_len) {
+        block.literal(src[pos]);
+        pos++;
+        cur_len = next_len;
+        cur_dist = next_dist;
+        continue;
+      }
+    }
+
+    block.match(cur_len, cur_dist);
+    if (cur_dist <= pixel_bytes && cur_len >= params.nice_length) {
+      matcher.skip_to(pos + cur_len - 4);
+    }
+    pos += cur_len;
+    matcher.insert_until(pos);
+    cur_len = 0;
+    if (pos < len) matcher.find(pos, cur_len, cur_dist);
+    matcher.insert_until(pos + 1);
+  }
+  block.flush(block_start, pos, true);
+  bw.align();
+  if (bw.overflow) {
+    return 0;
+  }
+
+  size_t total = 2 + bw.pos;
+  write_be_uint32(dst + total, adler32(adler32(0, nullptr, 0), src, static_cast<uInt>(len)));
+  total += 4;
+  debug_log("builtin_deflate: %zu -> %zu bytes", len, total);
+  return total;
+}
@@ -1,34 +1,259 @@
 #include <fstream>
+#include <climits>
 #include <vector>
 #include <cstdint>
 #include <algorithm>
 #include <cstdio>
 #include <cstring>
 #include <filesystem>
+#include <map>
+#include <future>
+#include <thread>
+#include <memory>
 #include "icns.h"
+#include "rle.h"
+#include "arena.h"
+#include "targets.h"
 #include <utils.h>
 #include <iostream>
 
-bool write_icns(const char* filename, const std::vector<PNGImage>& images) {
-  // Mapping of icon sizes to their corresponding ICNS type codes
-  struct IconMapping {
-    uint32_t size;
-    char code[5]; // 4 chars for code + null terminator
-  } mapping[] = {
-      {16, "icp4"},  // 16x16
-      {32, "icp5"},  // 32x32
-      {64, "icp6"},  // 64x64
-      {128, "ic07"}, // 128x128
-      {256, "ic08"}, // 256x256
-      {512, "ic09"}, // 512x512
-      {1024, "ic10"} // 1024x1024 (retina)
-  };
+// Mapping of icon sizes to their corresponding ICNS type codes. Several types
+// share a pixel size (e.g. ic11 is 16x16@2x, stored as a 32x32 PNG), so each
+// size is encoded once and the payload is referenced by every matching entry.
+enum class IconFormat {
+  PNG,   // PNG stream
+  RLE24, // Legacy PackBits-compressed planar RGB
+  Mask8  // Legacy uncompressed 8-bit alpha mask
+};
+
+struct IconMapping {
+  uint32_t size;
+  char code[5]; // 4 chars for code + null terminator
+  IconFormat format;
+  bool legacy_alternative; // PNG entry replaced by the legacy elements when RLE is selected
+};
+
+static const IconMapping mapping[] = {
+    {16, "is32", IconFormat::RLE24, false},   // 16x16 RGB
+    {16, "s8mk", IconFormat::Mask8, false},   // 16x16 mask
+    {32, "il32", IconFormat::RLE24, false},   // 32x32 RGB
+    {32, "l8mk", IconFormat::Mask8, false},   // 32x32 mask
+    {48, "ih32", IconFormat::RLE24, false},   // 48x48 RGB
+    {48, "h8mk", IconFormat::Mask8, false},   // 48x48 mask
+    {128, "it32", IconFormat::RLE24, false},  // 128x128 RGB
+    {128, "t8mk", IconFormat::Mask8, false},  // 128x128 mask
+    {16, "icp4", IconFormat::PNG, true},      // 16x16
+    {32, "icp5", IconFormat::PNG, true},      // 32x32
+    {64, "icp6", IconFormat::PNG, false},     // 64x64
+    {128, "ic07", IconFormat::PNG, true},     // 128x128
+    {256, "ic08", IconFormat::PNG, false},    // 256x256
+    {512, "ic09", IconFormat::PNG, false},    // 512x512
+    {1024, "ic10", IconFormat::PNG, false},   // 1024x1024 (512x512@2x)
+    {32, "ic11", IconFormat::PNG, false},     // 16x16@2x
+    {64, "ic12", IconFormat::PNG, false},     // 32x32@2x
+    {256, "ic13", IconFormat::PNG, false},    // 128x128@2x
+    {512, "ic14", IconFormat::PNG, false},    // 256x256@2x
+};
+
+static const IconMapping* find_mapping(const char* type) {
+  for (auto& m : mapping) {
+    if (std::memcmp(m.code, type, 4) == 0) return &m;
+  }
+  return nullptr;
+}
+
+// The legacy element of one size in one format, e.g. the mask paired with an
+// RGB element
+static const IconMapping* find_mapping(uint32_t size, IconFormat format) {
+  for (auto& m : mapping) {
+    if (m.size == size && m.format == format) return &m;
+  }
+  return nullptr;
+}
+
+static bool uses_rle(const IcnsOptions& options, uint32_t size) {
+  return std::find(options.rle_sizes.begin(), options.rle_sizes.end(), size) != options.rle_sizes.end();
+}
+
+static bool has_type(const IcnsOptions& options, const char* code) {
+  return std::find(options.types.begin(), options.types.end(), code) != options.types.end();
+}
+
+// Legacy elements are only written for sizes selected for RLE, and they
+// replace the 1x PNG entry of the same size unless --types names that entry too
+static bool is_selected(const IconMapping& m, const IcnsOptions& options) {
+  bool rle = uses_rle(options, m.size);
+  return m.format != IconFormat::PNG ? rle : !(rle && m.legacy_alternative && !has_type(options, m.code));
+}
+
+// Restricts the file to the sizes and element types asked for (everything by
+// default); a mask comes with its RGB element
+static bool is_requested(const IconMapping& m, const IcnsOptions& options) {
+  if (!options.sizes.empty() && std::find(options.sizes.begin(), options.sizes.end(), m.size) == options.sizes.end()) {
+    return false;
+  }
+  if (options.types.empty()) {
+    return true;
+  }
+  if (m.format == IconFormat::Mask8) {
+    const IconMapping* rgb = find_mapping(m.size, IconFormat::RLE24);
+    return rgb && has_type(options, rgb->code);
+  }
+  return has_type(options, m.code);
+}
 
-  std::vector<ICNSChunk> chunks;
+bool select_icns_types(const std::vector<std::string>& types, IcnsOptions& options) {
+  for (const std::string& type : types) {
+    auto m = std::find_if(std::begin(mapping), std::end(mapping), [&](const IconMapping& e) { return type == e.code; });
+    if (m == std::end(mapping) || m->format == IconFormat::Mask8) {
+      std::cerr << "select_icns_types: Unknown element type " << type << " (masks come with their RGB element)\n";
+      return false;
+    }
+    // Naming a legacy element asks for the RLE format at its size
+    if (m->format == IconFormat::RLE24 && !uses_rle(options, m->size)) {
+      options.rle_sizes.push_back(m->size);
+    }
+    options.types.push_back(type);
+  }
+  return true;
+}
 
+std::vector<uint32_t> icns_sizes(const IcnsOptions& options) {
+  std::vector<uint32_t> sizes;
   for (auto& m : mapping) {
+    if (is_selected(m, options) && is_requested(m, options) && std::find(sizes.begin(), sizes.end(), m.size) == sizes.end()) {
+      sizes.push_back(m.size);
+    }
+  }
+  std::sort(sizes.begin(), sizes.end());
+  return sizes;
+}
+
+bool icns_needs_pixels(uint32_t size, const IcnsOptions& options) {
+  for (auto& m : mapping) {
+    if (m.size == size && m.format != IconFormat::PNG && is_selected(m, options) && is_requested(m, options)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+PNGPayload encode_icon_png(const ImageView& source, const IcnsOptions& options) {
+  auto embedded = options.png_passthrough.find(source.width);
+  if (embedded != options.png_passthrough.end() && source.width == source.height) {
+    return embedded->second;
+  }
+
+  // Small PNG elements are encoded from their palette-quantized pixels when
+  // that stays within the quality bound. Without reduction the result would
+  // still be written as RGBA, losing quality for nothing.
+  ScratchLease scratch;
+  ImageView img = source;
+  if (options.quantize.enabled && options.png.reduce && source.width <= options.quantize.max_size) {
+    ImageView quantized = scratch->allocate_image(source.width, source.height, PixelLayout::Interleaved);
+    if (quantized.planes[0] && quantize_image(source, quantized, options.quantize)) {
+      img = quantized;
+    }
+  }
+
+  if (options.cache) {
+    // Reuse a cached payload when the pixels are unchanged
+    return options.cache->get_or_encode(img, options.png);
+  }
+  auto data = std::make_shared<std::vector<uint8_t>>();
+  if (!encode_png(img, *data, options.png)) {
+    return nullptr;
+  }
+  return PNGPayload(std::move(data));
+}
+
+static PNGPayload encode_entry(const IconMapping& m, const ImageView& img, const IcnsOptions& options) {
+  if (m.format == IconFormat::PNG) {
+    return options.payloads ? options.payloads->get(img) : encode_icon_png(img, options);
+  }
+
+  auto data = std::make_shared<std::vector<uint8_t>>();
+  bool ok = false;
+  switch (m.format) {
+  case IconFormat::PNG:
+    break;
+  case IconFormat::RLE24:
+    ok = encode_icns_rle(img, *data, std::memcmp(m.code, "it32", 4) == 0);
+    break;
+  case IconFormat::Mask8:
+    ok = encode_icns_mask(img, *data);
+    break;
+  }
+  return ok ? PNGPayload(std::move(data)) : nullptr;
+}
+
+bool IcnsStreamWriter::open(const char* filename, uint32_t total_size, const OutputOptions& output) {
+  declared_total_ = total_size;
+  if (!out_.open(filename, output)) {
+    return false;
+  }
+
+  // ICNS file header; the length is back-patched in finish() when not known yet
+  uint8_t header[8];
+  std::memcpy(header, "icns", 4);
+  write_be_uint32(header + 4, total_size);
+  return out_.write(header, 8);
+}
+
+bool IcnsStreamWriter::add(const char* type, const uint8_t* data, size_t size) {
+  if (out_.position() + 8 + size > UINT32_MAX) {
+    std::cerr << "IcnsStreamWriter: " << out_.filename() << " would exceed the 4 GB ICNS limit\n";
+    return false;
+  }
+
+  // Element header and payload go out in one gathered write
+  uint8_t header[8];
+  std::memcpy(header, type, 4); // Chunk type
+  write_be_uint32(header + 4, static_cast<uint32_t>(size) + 8); // Chunk size (data size + 8 bytes for type+size)
+  IoSegment segments[2] = { { header, 8 }, { data, size } };
+  if (!out_.write(segments, 2)) {
+    return false;
+  }
+  debug_log("Wrote chunk type %.4s, data size %zu", type, size);
+  return true;
+}
+
+bool IcnsStreamWriter::finish() {
+  uint64_t total = out_.position();
+  if (declared_total_ != 0 && declared_total_ != total) {
+    std::cerr << "IcnsStreamWriter: Wrote " << total << " bytes but declared " << declared_total_ << "\n";
+    out_.discard();
+    return false;
+  }
+  if (declared_total_ == 0) {
+    uint8_t size_buf[4];
+    write_be_uint32(size_buf, static_cast<uint32_t>(total));
+    if (!out_.write_at(4, size_buf, 4)) {
+      out_.discard();
+      return false;
+    }
+  }
+  debug_log("Finished ICNS file %s: %llu bytes", out_.filename().c_str(), (unsigned long long)total);
+  return out_.close();
+}
+
+bool write_icns(const char* filename, const std::vector<ImageView>& images, const IcnsOptions& options) {
+  using Key = std::pair<IconFormat, uint32_t>; // (format, pixel size)
+
+  // Plan the elements first so a missing size fails before the file is touched
+  struct PlannedEntry {
+    const IconMapping* mapping;
+    const ImageView* image;
+  };
+  std::vector<PlannedEntry> plan;
+  std::map<Key, size_t> remaining_uses;
+  for (auto& m : mapping) {
+    if (!is_selected(m, options) || !is_requested(m, options)) {
+      continue;
+    }
+
     // Find the image in the input vector that matches the current size
-    auto it = std::find_if(images.begin(), images.end(), [&](const PNGImage& img) {
+    auto it = std::find_if(images.begin(), images.end(), [&](const ImageView& img) {
       return img.width == m.size && img.height == m.size;
       });
 
@@ -38,73 +263,316 @@ bool write_icns(const char* filename, const std::vector<PNGImage>& images) {
       return false;
     }
 
-    // Create a temporary filename for the PNG
-    // Using a more unique name for temp file to avoid conflicts
-    std::string tmpname = std::string("tmp_icns_icon_") + std::to_string(m.size) + ".png";
+    plan.push_back({ &m, &*it });
+    remaining_uses[{ m.format, m.size }]++;
+  }
+  // A partial file is fine, an empty one is not
+  if (plan.empty()) {
+    std::cerr << "write_icns: No elements selected for " << filename << "\n";
+    return false;
+  }
+
+  // Encode each distinct (format, size) once on a worker thread, keeping only a
+  // bounded number in flight; elements are written in table order as soon as
+  // their payload is ready, and a payload is released after its last use.
+  const size_t max_in_flight = std::max(2u, std::thread::hardware_concurrency());
+  std::map<Key, std::shared_future<PNGPayload>> encoded;
+  size_t next_to_launch = 0;
+  auto launch_ahead = [&](size_t cursor) {
+    while (next_to_launch < plan.size() && (next_to_launch <= cursor || encoded.size() < max_in_flight)) {
+      const PlannedEntry& p = plan[next_to_launch++];
+      Key key{ p.mapping->format, p.mapping->size };
+      if (encoded.count(key) == 0) {
+        encoded[key] = std::async(std::launch::async, encode_entry, std::cref(*p.mapping), std::cref(*p.image), std::cref(options)).share();
+      }
+    }
+  };
 
-    // Write the PNG image data to the temporary file
-    if (!write_png(tmpname, it->pixels, it->width, it->height)) {
-      debug_log("Failed to write temp PNG for size %u: %s", m.size, tmpname.c_str());
-      std::cerr << "write_icns: Failed to write temp PNG for size " << m.size << "\n";
+  auto next_payload = [&](size_t i) -> PNGPayload {
+    launch_ahead(i);
+    const IconMapping& m = *plan[i].mapping;
+    Key key{ m.format, m.size };
+    PNGPayload payload = encoded[key].get();
+    if (!payload) {
+      debug_log("Failed to encode %.4s for size %u", m.code, m.size);
+      std::cerr << "write_icns: Failed to encode " << m.code << " for size " << m.size << "\n";
+    }
+    if (--remaining_uses[key] == 0) {
+      encoded.erase(key);
+    }
+    return payload;
+  };
+
+  // Standard output cannot be back-patched, so every payload is encoded first
+  // and the header goes out with the final length already in it
+  std::vector<PNGPayload> payloads;
+  uint64_t total = 0;
+  bool ok = true;
+  if (is_stdio_path(filename)) {
+    total = 8;
+    for (size_t i = 0; i < plan.size() && ok; ++i) {
+      payloads.push_back(next_payload(i));
+      ok = payloads.back() != nullptr;
+      if (ok) total += 8 + payloads.back()->size();
+    }
+    if (ok && total > UINT32_MAX) {
+      std::cerr << "write_icns: Output would exceed the 4 GB ICNS limit\n";
+      ok = false;
+    }
+    if (!ok) {
+      for (auto& e : encoded) e.second.wait();
       return false;
     }
+  }
+
+  IcnsStreamWriter writer;
+  if (!writer.open(filename, static_cast<uint32_t>(total), options.output)) {
+    std::cerr << "write_icns: Failed to open " << filename << " for writing.\n";
+    for (auto& e : encoded) e.second.wait();
+    return false;
+  }
 
-    // Read the temporary PNG file back into a vector of bytes
-    std::ifstream temp_png_file(tmpname, std::ios::binary | std::ios::ate); // Open at end to get size
-    if (!temp_png_file.is_open()) {
-      debug_log("Failed to open temporary PNG file %s for reading.", tmpname.c_str());
-      std::cerr << "write_icns: Failed to open temp PNG for reading: " << tmpname << "\n";
+  for (size_t i = 0; i < plan.size() && ok; ++i) {
+    PNGPayload payload = i < payloads.size() ? std::move(payloads[i]) : next_payload(i);
+    ok = payload && writer.add(plan[i].mapping->code, payload->data(), payload->size());
+  }
+
+  // Let outstanding encodes finish before the options they reference go away
+  for (auto& e : encoded) e.second.wait();
+
+  // On failure the temporary file is dropped and an existing icon is left intact
+  if (!ok) {
+    writer.discard();
+    return false;
+  }
+  if (!writer.finish()) {
+    return false;
+  }
+
+  debug_log("Successfully wrote ICNS file: %s", filename);
+  return true;
+}
+
+bool index_icns(const uint8_t* data, size_t size, std::vector<ICNSEntry>& entries) {
+  entries.clear();
+  if (size < 8 || std::memcmp(data, "icns", 4) != 0) {
+    std::cerr << "index_icns: Missing icns header\n";
+    return false;
+  }
+
+  uint32_t total_size = read_be_uint32(data + 4);
+  if (total_size < 8 || total_size > size) {
+    std::cerr << "index_icns: Header size " << total_size << " does not fit file of " << size << " bytes\n";
+    return false;
+  }
+
+  size_t pos = 8;
+  while (pos < total_size) {
+    if (total_size - pos < 8) {
+      std::cerr << "index_icns: Truncated element header at offset " << pos << "\n";
+      return false;
+    }
+    uint32_t element_size = read_be_uint32(data + pos + 4);
+    if (element_size < 8 || element_size > total_size - pos) {
+      std::cerr << "index_icns: Invalid element size " << element_size << " at offset " << pos << "\n";
       return false;
     }
 
-    std::streampos sz = temp_png_file.tellg(); // Get file size
-    std::vector<uint8_t> pngdata(static_cast<size_t>(sz));
-    temp_png_file.seekg(0, std::ios::beg); // Go back to beginning
-    temp_png_file.read(reinterpret_cast<char*>(pngdata.data()), sz); // Read all data
-    temp_png_file.close();
+    ICNSEntry e;
+    std::memcpy(e.type, data + pos, 4);
+    e.offset = pos + 8;
+    e.length = element_size - 8;
+    entries.push_back(e);
+    debug_log("Indexed element %.4s at offset %zu, %u bytes", e.type, e.offset, e.length);
 
-    // Delete the temporary PNG file
-    std::filesystem::remove(tmpname);
-    debug_log("Temporary PNG file %s deleted.", tmpname.c_str());
+    pos += element_size;
+  }
+  return true;
+}
 
-    // Create an ICNSChunk and add it to the list
-    ICNSChunk c;
-    std::memcpy(c.type, m.code, 4); // Copy the 4-char code
-    c.data = std::move(pngdata); // Move the PNG data
-    chunks.push_back(std::move(c));
-    debug_log("Added ICNS chunk for size %u, type %.4s, data size %zu", m.size, m.code, chunks.back().data.size());
+bool ICNSReader::open(const std::string& filename) {
+  filename_ = filename;
+  entries_.clear();
+  if (!file_.open(filename)) {
+    std::cerr << "ICNSReader: Failed to open " << filename << "\n";
+    return false;
+  }
+  if (!index_icns(file_.data(), file_.size(), entries_)) {
+    std::cerr << "ICNSReader: " << filename << " is not a valid ICNS file\n";
+    return false;
   }
+  return true;
+}
 
-  // Calculate total size of the .icns file
-  uint32_t total_size = 8; // "icns" header (4 bytes type + 4 bytes size)
-  for (auto& c : chunks) {
-    total_size += 8 + (uint32_t)c.data.size(); // Each chunk has 4 bytes type + 4 bytes size + data
+const ICNSEntry* ICNSReader::find(const char* type) const {
+  for (auto& e : entries_) {
+    if (std::memcmp(e.type, type, 4) == 0) return &e;
   }
-  debug_log("Calculated total ICNS file size: %u bytes", total_size);
+  return nullptr;
+}
 
-  // Open the output .icns file for writing
-  std::ofstream out_icns_file(filename, std::ios::binary);
-  if (!out_icns_file.is_open()) {
-    std::cerr << "write_icns: Failed to open " << filename << " for writing.\n";
+bool ICNSReader::is_image(const ICNSEntry& entry) const {
+  return find_mapping(entry.type) ||
+    (entry.length >= 8 && std::memcmp(payload(entry), "\x89PNG\r\n\x1a\n", 8) == 0);
+}
+
+bool ICNSReader::decode(const char* type, PNGImage& out) const {
+  const ICNSEntry* e = find(type);
+  if (!e) {
+    std::cerr << "ICNSReader: No " << std::string(type, 4) << " element in " << filename_ << "\n";
     return false;
   }
 
-  // Write ICNS file header
-  out_icns_file.write("icns", 4); // File type
-  uint8_t size_buf[4];
-  write_be_uint32(size_buf, total_size);
-  out_icns_file.write(reinterpret_cast<char*>(size_buf), 4); // Total file size
+  const uint8_t* data = payload(*e);
+  if (e->length >= 8 && std::memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0) {
+    return decode_png(data, e->length, out, filename_ + ":" + std::string(type, 4));
+  }
 
-  // Write each ICNS chunk
-  for (auto& c : chunks) {
-    out_icns_file.write(c.type, 4); // Chunk type
-    write_be_uint32(size_buf, (uint32_t)c.data.size() + 8); // Chunk size (data size + 8 bytes for type+size)
-    out_icns_file.write(reinterpret_cast<char*>(size_buf), 4);
-    out_icns_file.write(reinterpret_cast<const char*>(c.data.data()), c.data.size()); // Chunk data
-    debug_log("Wrote chunk type %.4s, data size %zu", c.type, c.data.size());
+  const IconMapping* m = find_mapping(type);
+  if (m && m->format == IconFormat::RLE24) {
+    const IconMapping* mask_mapping = find_mapping(m->size, IconFormat::Mask8);
+    const ICNSEntry* mask = mask_mapping ? find(mask_mapping->code) : nullptr;
+    const size_t count = static_cast<size_t>(m->size) * m->size;
+    const uint8_t* alpha = (mask && mask->length == count) ? payload(*mask) : nullptr;
+    return decode_icns_rle(data, e->length, m->size, alpha, std::memcmp(type, "it32", 4) == 0, out);
+  }
+  if (m && m->format == IconFormat::Mask8 && e->length == static_cast<size_t>(m->size) * m->size) {
+    // A bare mask decodes to white pixels carrying the mask as alpha
+    out.width = m->size;
+    out.height = m->size;
+    out.pixels.resize(e->length);
+    for (uint32_t i = 0; i < e->length; ++i) {
+      out.pixels[i] = Pixel{ 255, 255, 255, data[i] };
+    }
+    return true;
   }
 
-  out_icns_file.close();
-  debug_log("Successfully wrote ICNS file: %s", filename);
+  std::cerr << "ICNSReader: Unsupported element type " << std::string(type, 4) << " in " << filename_ << "\n";
+  return false;
+}
+
+bool update_icns(const char* filename, const std::vector<ImageView>& images, const IcnsOptions& options) {
+  // One element of the updated file: either kept from the existing file or a new payload
+  struct Slot {
+    char type[4];
+    size_t old_offset;  // Payload offset in the existing file (0 for new payloads)
+    uint32_t length;
+    PNGPayload payload; // Set when the element was re-encoded with different bytes
+  };
+
+  MappedFile file;
+  std::vector<ICNSEntry> entries;
+  if (!file.open(filename) || !index_icns(file.data(), file.size(), entries)) {
+    std::cerr << "update_icns: " << filename << " is not a readable ICNS file\n";
+    return false;
+  }
+
+  std::vector<Slot> slots;
+  for (auto& e : entries) {
+    Slot slot;
+    std::memcpy(slot.type, e.type, 4);
+    slot.old_offset = e.offset;
+    slot.length = e.length;
+    slots.push_back(slot);
+  }
+  auto find_slot = [&](const char* code) {
+    return std::find_if(slots.begin(), slots.end(), [&](const Slot& s) { return std::memcmp(s.type, code, 4) == 0; });
+  };
+
+  bool changed = false;
+  for (const ImageView& img : images) {
+    // The file keeps the element types it already has for this size (PNG or
+    // legacy RLE) rather than switching to what the options would select
+    bool size_present = false;
+    for (auto& m : mapping) {
+      size_present = size_present || (m.size == img.width && find_slot(m.code) != slots.end());
+    }
+
+    for (auto& m : mapping) {
+      // Elements outside --sizes/--types are left as they are
+      if (m.size != img.width || m.size != img.height || !is_requested(m, options)) {
+        continue;
+      }
+      // A missing element is added for a new size, or when --types (already
+      // checked by is_requested, masks included) names it
+      auto existing = find_slot(m.code);
+      if (existing == slots.end() && !(is_selected(m, options) && (!size_present || !options.types.empty()))) {
+        continue;
+      }
+
+      PNGPayload payload = encode_entry(m, img, options);
+      if (!payload) {
+        std::cerr << "update_icns: Failed to encode " << m.code << " for size " << m.size << "\n";
+        return false;
+      }
+
+      if (existing == slots.end()) {
+        Slot slot;
+        std::memcpy(slot.type, m.code, 4);
+        slot.old_offset = 0;
+        slot.length = static_cast<uint32_t>(payload->size());
+        slot.payload = std::move(payload);
+        slots.push_back(std::move(slot));
+        changed = true;
+        debug_log("update_icns: Adding element %.4s", m.code);
+      }
+      else if (existing->payload || existing->length != payload->size() ||
+        std::memcmp(file.data() + existing->old_offset, payload->data(), payload->size()) != 0) {
+        existing->length = static_cast<uint32_t>(payload->size());
+        existing->payload = std::move(payload);
+        changed = true;
+        debug_log("update_icns: Replacing element %.4s", m.code);
+      }
+    }
+  }
+  if (!changed) {
+    debug_log("update_icns: %s is already up to date", filename);
+    return true;
+  }
+
+  uint64_t total = 8;
+  for (auto& s : slots) total += 8 + static_cast<uint64_t>(s.length);
+  if (total > UINT32_MAX) {
+    std::cerr << "update_icns: Updated file would exceed the 4 GB ICNS limit\n";
+    return false;
+  }
+
+  // The result goes to a temporary file that replaces the original only once
+  // complete, so a crash or a full disk leaves the old icon intact. Kept
+  // elements are copied straight from the mapping.
+  IcnsStreamWriter writer;
+  if (!writer.open(filename, static_cast<uint32_t>(total), options.output)) {
+    return false;
+  }
+  for (auto& s : slots) {
+    const uint8_t* data = s.payload ? s.payload->data() : file.data() + s.old_offset;
+    if (!writer.add(s.type, data, s.length)) {
+      return false;
+    }
+  }
+  // Unmap before the rename, which Windows refuses over a mapped file
+  file.close();
+  if (!writer.finish()) {
+    return false;
+  }
+  debug_log("update_icns: Rewrote %s (%llu bytes)", filename, (unsigned long long)total);
   return true;
 }
+
+// Views over PNGImage pixels; nothing is copied
+static std::vector<ImageView> views_of(const std::vector<PNGImage>& images) {
+  std::vector<ImageView> views;
+  views.reserve(images.size());
+  for (const PNGImage& img : images) {
+    views.push_back(ImageView::interleaved(img.pixels.data(), img.width, img.height));
+  }
+  return views;
+}
+
+bool write_icns(const char* filename, const std::vector<PNGImage>& images, const IcnsOptions& options) {
+  return write_icns(filename, views_of(images), options);
+}
+
+bool update_icns(const char* filename, const std::vector<PNGImage>& images, const IcnsOptions& options) {
+  return update_icns(filename, views_of(images), options);
+}
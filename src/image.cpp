@@ -0,0 +1,142 @@
+#include <cstring>
+#include <iostream>
+#include <utility>
+#include "image.h"
+#include "utils.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IMAGE_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+static size_t align_up(size_t n, size_t alignment) {
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+ImageBuffer::~ImageBuffer() {
+  aligned_free(data_);
+}
+
+ImageBuffer::ImageBuffer(ImageBuffer&& other) noexcept {
+  *this = std::move(other);
+}
+
+ImageBuffer& ImageBuffer::operator=(ImageBuffer&& other) noexcept {
+  if (this != &other) {
+    std::swap(data_, other.data_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(view_, other.view_);
+  }
+  return *this;
+}
+
+bool ImageBuffer::reset(uint32_t width, uint32_t height, PixelLayout layout) {
+  const int plane_count = layout == PixelLayout::Planar ? 4 : 1;
+  const size_t row_bytes = static_cast<size_t>(width) * (layout == PixelLayout::Planar ? 1 : 4);
+  const size_t stride = align_up(row_bytes == 0 ? 1 : row_bytes, kAlignment);
+  const size_t plane_size = stride * height;
+  const size_t needed = plane_size * plane_count;
+
+  if (needed > capacity_) {
+    aligned_free(data_);
+    data_ = static_cast<uint8_t*>(aligned_malloc(needed, kAlignment));
+    capacity_ = data_ ? needed : 0;
+    if (!data_) {
+      std::cerr << "ImageBuffer: Failed to allocate " << needed << " bytes for " << width << "x" << height << "\n";
+      view_ = ImageView();
+      return false;
+    }
+  }
+
+  view_.layout = layout;
+  view_.width = width;
+  view_.height = height;
+  view_.stride = stride;
+  for (int p = 0; p < 4; ++p) {
+    view_.planes[p] = p < plane_count ? data_ + p * plane_size : nullptr;
+  }
+  return true;
+}
+
+// Splits n RGBA quads into four channel rows
+static void deinterleave_row(const uint8_t* src, uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* a, uint32_t n) {
+  uint32_t x = 0;
+#ifdef IMAGE_USE_SSE2
+  const __m128i mask = _mm_set1_epi32(0xFF);
+  for (; x + 16 <= n; x += 16) {
+    __m128i v[4];
+    for (int i = 0; i < 4; ++i) {
+      v[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (x + i * 4) * 4));
+    }
+    __m128i c[4][4];
+    for (int i = 0; i < 4; ++i) {
+      c[0][i] = _mm_and_si128(v[i], mask);
+      c[1][i] = _mm_and_si128(_mm_srli_epi32(v[i], 8), mask);
+      c[2][i] = _mm_and_si128(_mm_srli_epi32(v[i], 16), mask);
+      c[3][i] = _mm_srli_epi32(v[i], 24);
+    }
+    uint8_t* out[4] = { r, g, b, a };
+    for (int ch = 0; ch < 4; ++ch) {
+      __m128i lo = _mm_packs_epi32(c[ch][0], c[ch][1]);
+      __m128i hi = _mm_packs_epi32(c[ch][2], c[ch][3]);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out[ch] + x), _mm_packus_epi16(lo, hi));
+    }
+  }
+#endif
+  for (; x < n; ++x) {
+    r[x] = src[x * 4];
+    g[x] = src[x * 4 + 1];
+    b[x] = src[x * 4 + 2];
+    a[x] = src[x * 4 + 3];
+  }
+}
+
+// Merges four channel rows into n RGBA quads
+static void interleave_row(const uint8_t* r, const uint8_t* g, const uint8_t* b, const uint8_t* a, uint8_t* dst, uint32_t n) {
+  uint32_t x = 0;
+#ifdef IMAGE_USE_SSE2
+  for (; x + 16 <= n; x += 16) {
+    __m128i vr = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + x));
+    __m128i vg = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + x));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x));
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + x));
+    __m128i rg_lo = _mm_unpacklo_epi8(vr, vg);
+    __m128i rg_hi = _mm_unpackhi_epi8(vr, vg);
+    __m128i ba_lo = _mm_unpacklo_epi8(vb, va);
+    __m128i ba_hi = _mm_unpackhi_epi8(vb, va);
+    __m128i* out = reinterpret_cast<__m128i*>(dst + x * 4);
+    _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(rg_lo, ba_lo));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(rg_lo, ba_lo));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(rg_hi, ba_hi));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(rg_hi, ba_hi));
+  }
+#endif
+  for (; x < n; ++x) {
+    dst[x * 4] = r[x];
+    dst[x * 4 + 1] = g[x];
+    dst[x * 4 + 2] = b[x];
+    dst[x * 4 + 3] = a[x];
+  }
+}
+
+void convert_layout(const ImageView& src, const ImageView& dst) {
+  const uint32_t w = src.width < dst.width ? src.width : dst.width;
+  const uint32_t h = src.height < dst.height ? src.height : dst.height;
+
+  for (uint32_t y = 0; y < h; ++y) {
+    if (src.layout == PixelLayout::Interleaved && dst.layout == PixelLayout::Interleaved) {
+      std::memcpy(dst.row(y), src.row(y), static_cast<size_t>(w) * 4);
+    }
+    else if (src.layout == PixelLayout::Interleaved) {
+      deinterleave_row(src.row(y), dst.row(y, 0), dst.row(y, 1), dst.row(y, 2), dst.row(y, 3), w);
+    }
+    else if (dst.layout == PixelLayout::Interleaved) {
+      interleave_row(src.row(y, 0), src.row(y, 1), src.row(y, 2), src.row(y, 3), dst.row(y), w);
+    }
+    else {
+      for (int p = 0; p < 4; ++p) {
+        std::memcpy(dst.row(y, p), src.row(y, p), w);
+      }
+    }
+  }
+}
@@ -1,33 +1,66 @@
+#include <cstdio>
 #include "jpg.h"
 
-bool load_jpeg_gdiplus(const wchar_t* filename, PNGImage& out) {
-    Gdiplus::Bitmap bitmap(filename);
-    if (bitmap.GetLastStatus() != Gdiplus::Ok) {
-        return false;
-    }
+#ifdef _WIN32
+#include <windows.h>
+#include <objidl.h>
+#include <shlwapi.h>
+#include <gdiplus.h>
 
-    UINT w = bitmap.GetWidth();
-    UINT h = bitmap.GetHeight();
+// GDI+ must be started once per process before any Bitmap is created
+static bool start_gdiplus() {
+  static const bool ok = [] {
+    Gdiplus::GdiplusStartupInput input;
+    ULONG_PTR token = 0;
+    return Gdiplus::GdiplusStartup(&token, &input, nullptr) == Gdiplus::Ok;
+  }();
+  return ok;
+}
 
-    out.width = w;
-    out.height = h;
-    out.pixels.resize(w * h * 4);
+bool decode_jpeg(const uint8_t* data, size_t size, const std::string& source, PNGImage& out) {
+  if (size > UINT_MAX || !start_gdiplus()) {
+    std::fprintf(stderr, "decode_jpeg: Cannot decode %s\n", source.c_str());
+    return false;
+  }
+  IStream* stream = SHCreateMemStream(data, static_cast<UINT>(size));
+  if (!stream) {
+    return false;
+  }
 
-    for (UINT y = 0; y < h; y++) {
+  bool ok = false;
+  {
+    Gdiplus::Bitmap bitmap(stream);
+    UINT w = bitmap.GetWidth();
+    UINT h = bitmap.GetHeight();
+    Gdiplus::Rect rect(0, 0, static_cast<INT>(w), static_cast<INT>(h));
+    Gdiplus::BitmapData locked;
+    // One locked copy of the pixels instead of a GetPixel call per pixel
+    if (bitmap.GetLastStatus() == Gdiplus::Ok &&
+      bitmap.LockBits(&rect, Gdiplus::ImageLockModeRead, PixelFormat32bppARGB, &locked) == Gdiplus::Ok) {
+      out.width = w;
+      out.height = h;
+      out.pixels.resize(static_cast<size_t>(w) * h);
+      for (UINT y = 0; y < h; y++) {
+        const BYTE* row = static_cast<const BYTE*>(locked.Scan0) + static_cast<ptrdiff_t>(y) * locked.Stride;
+        Pixel* dst = out.pixels.data() + static_cast<size_t>(y) * w;
         for (UINT x = 0; x < w; x++) {
-            Gdiplus::Color c;
-            bitmap.GetPixel(x, y, &c);
-            BYTE r = c.GetR();
-            BYTE g = c.GetG();
-            BYTE b = c.GetB();
-
-            size_t idx = (y * w + x) * 4;
-            out.pixels[idx + 0] = r;
-            out.pixels[idx + 1] = g;
-            out.pixels[idx + 2] = b;
-            out.pixels[idx + 3] = 255;  // JPEG has no alpha, opaque
+          // BGRA in memory; JPEG has no alpha, so every pixel is opaque
+          dst[x] = Pixel{ row[x * 4 + 2], row[x * 4 + 1], row[x * 4 + 0], 255 };
         }
+      }
+      bitmap.UnlockBits(&locked);
+      ok = true;
     }
+  }
+  stream->Release();
+  return ok;
+}
 
-    return true;
+#else
+
+bool decode_jpeg(const uint8_t*, size_t, const std::string& source, PNGImage&) {
+  std::fprintf(stderr, "decode_jpeg: JPEG sources need GDI+ and are only supported on Windows (%s)\n", source.c_str());
+  return false;
 }
+
+#endif
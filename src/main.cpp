@@ -2,96 +2,127 @@
 #include <vector>
 #include <string>
 #include <cstdint>
-#include <algorithm>
-#include <fstream>
-
-#ifdef _DEBUG
-#include <filesystem>
-#endif
+#include <cstring>
+#include <cstdlib>
 
 #include "png.h"
-#include "jpg.h"
 #include "icns.h"
 #include "crc.h"
-
-bool load_image(const char* filename, PNGImage& out) {
-  // Check if file exists and is readable
-  std::ifstream file_check(filename, std::ios::binary);
-  if (!file_check.is_open()) {
-    std::fprintf(stderr, "Error: Cannot open file %s (file may not exist or is inaccessible)\n", filename);
-    return false;
+#include "convert.h"
+#include "daemon.h"
+#include "watch.h"
+#include "utils.h"
+
+// Lists the elements of an existing .icns, decoding each one to validate it
+static int list_icns(const char* filename) {
+  ICNSReader reader;
+  if (!reader.open(filename)) {
+    return 1;
   }
-  file_check.close();
-
-  // Get lowercase extension
-  std::string file_str(filename);
-  std::transform(file_str.begin(), file_str.end(), file_str.begin(), ::tolower);
-  std::string ext = file_str.size() >= 4 ? file_str.substr(file_str.size() - 4) : "";
 
-  // Handle supported extensions
-  if (ext == ".png") {
-    if (!load_simple_png(filename, out)) {
-      std::fprintf(stderr, "Error: Failed to load PNG file %s (possible corruption or unsupported format)\n", filename);
-      return false;
+  int failures = 0;
+  for (const ICNSEntry& e : reader.entries()) {
+    PNGImage img;
+    std::string type(e.type, 4);
+    if (!reader.is_image(e)) {
+      // Table of contents, version and other metadata
+      std::printf("%s %10u bytes  (not an image)\n", type.c_str(), e.length);
     }
-    return true;
-  }
-  if (ext == ".jpg" || (file_str.size() >= 5 && file_str.substr(file_str.size() - 5) == ".jpeg")) {
-    if (!load_jpeg(filename, out)) {
-      std::fprintf(stderr, "Error: Failed to load JPEG file %s\n", filename);
-      return false;
+    else if (reader.decode(type.c_str(), img)) {
+      std::printf("%s %10u bytes  %ux%u\n", type.c_str(), e.length, img.width, img.height);
+    }
+    else {
+      std::printf("%s %10u bytes  (not decoded)\n", type.c_str(), e.length);
+      failures++;
     }
-    return true;
   }
-
-  std::fprintf(stderr, "Error: Unsupported file extension for %s (must be .png, .jpg, or .jpeg)\n", filename);
-  return false;
+  return failures == 0 ? 0 : 1;
 }
 
-
-int main(int argc, char* argv[]) {
-  if (argc < 3) {
-    std::printf("Usage: %s input.png|input.jpg output.icns\n", argv[0]);
+// Decodes a single element of an .icns and writes it out as a PNG
+static int extract_icns(const char* filename, const char* type, const char* output) {
+  ICNSReader reader;
+  PNGImage img;
+  if (std::strlen(type) != 4 || !reader.open(filename) || !reader.decode(type, img)) {
+    std::fprintf(stderr, "Error: Cannot extract %s from %s\n", type, filename);
     return 1;
   }
-
-  PNGImage original;
-  if (!load_image(argv[1], original)) {
-    std::printf("Failed to load image: %s\n", argv[1]);
+  if (!write_png(output, img.pixels, img.width, img.height)) {
     return 1;
   }
+  std::printf("Extracted %s (%ux%u) to %s\n", type, img.width, img.height, output);
+  return 0;
+}
+
 
-  uint32_t sizes[] = { 16, 32, 64, 128, 256, 512, 1024 };
-  std::vector<PNGImage> icons;
-  for (uint32_t sz : sizes) {
-    PNGImage resized;
-    resize_nn(original, resized, sz, sz);
-    icons.push_back(std::move(resized));
+int main(int argc, char* argv[]) {
+  if (argc == 3 && std::strcmp(argv[1], "--list") == 0) {
+    return list_icns(argv[2]);
+  }
+  if (argc == 5 && std::strcmp(argv[1], "--extract") == 0) {
+    return extract_icns(argv[2], argv[3], argv[4]);
   }
 
-#ifdef _DEBUG
-  namespace fs = std::filesystem;
-  fs::path debug_folder = "debug_images";
-  if (!fs::exists(debug_folder)) fs::create_directory(debug_folder);
+  if (argc >= 3 && std::strcmp(argv[1], "--serve") == 0) {
+    std::string cache_dir;
+    unsigned workers = 0;
+    for (int i = 3; i < argc; ++i) {
+      if (std::strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+        cache_dir = argv[++i];
+      }
+      else if (std::strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+        workers = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+      }
+      else {
+        std::fprintf(stderr, "Error: Unknown server option %s\n", argv[i]);
+        return 1;
+      }
+    }
+    make_crc_table();
+    return run_server(argv[2], cache_dir, workers);
+  }
+  if (argc >= 3 && std::strcmp(argv[1], "--client") == 0) {
+    if (argc == 4 && std::strcmp(argv[3], "--stop") == 0) {
+      return stop_server(argv[2]);
+    }
+    bool send_input = argc > 3 && std::strcmp(argv[3], "--send-input") == 0;
+    int first = send_input ? 4 : 3;
+    return run_client(argv[2], std::vector<std::string>(argv + first, argv + argc), send_input);
+  }
 
-  char buf[128];
-  for (size_t i = 0; i < icons.size(); ++i) {
-    std::snprintf(buf, sizeof(buf), "debug_%u.png", sizes[i]);
-    fs::path debug_path = debug_folder / buf;
+  if (argc < 3) {
+    std::printf("Usage: %s input.png|input.jpg output.icns [--cache dir] [--rle 16,32,48,128] [--update sizes] [--fsync] [--direct-io] [--deflate zlib|builtin] [--optimize] [--optimize-time seconds] [--no-reduce] [--no-quantize] [--dither] [--quantize-quality dB] [--watch [--debounce ms]] [--output file.ico|file.cur|dir.iconset|file.icns]... [--hotspot x,y] [--sizes list] [--types list] [--profile file] [--size n=file]... [--passthrough] [--strip-chunks]\n", argv[0]);
+    std::printf("       %s - - [options] < input.png > output.icns\n", argv[0]);
+    std::printf("       %s --list file.icns\n", argv[0]);
+    std::printf("       %s --extract file.icns type output.png\n", argv[0]);
+    std::printf("       %s --serve socket [--cache dir] [--workers n]\n", argv[0]);
+    std::printf("       %s --client socket [--send-input] input output.icns [options]\n", argv[0]);
+    std::printf("       %s --client socket --stop\n", argv[0]);
+    return 1;
+  }
 
-    if (!write_png(debug_path.string().c_str(), icons[i].pixels, icons[i].width, icons[i].height)) {
-      std::fprintf(stderr, "Failed to write debug PNG: %s\n", debug_path.string().c_str());
-    }
+  std::vector<std::string> args(argv + 1, argv + argc);
+  ConvertJob job;
+  if (!parse_convert_args(args, job)) {
+    return 1;
   }
-#endif
 
   make_crc_table();
 
-  if (!write_icns(argv[2], icons)) {
-    std::printf("Failed to write ICNS: %s\n", argv[2]);
+  // With --cache, sizes whose pixels match a previous run reuse the stored PNG payload
+  PayloadCache cache(job.cache_dir);
+  if (job.watch) {
+    // Unchanged sizes of an edited source are always served from memory
+    cache.set_memory_limit(256u << 20);
+    return run_watch(job, &cache);
+  }
+  if (!run_conversion(job, job.cache_dir.empty() ? nullptr : &cache)) {
     return 1;
   }
-
-  std::printf("ICNS file created successfully: %s\n", argv[2]);
+  // Standard output carries the icon itself
+  if (is_stdio_path(job.output)) {
+    return 0;
+  }
+  std::printf("%s\n", describe_result(job).c_str());
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include "optimize.h"
+#include "arena.h"
+#include "deflate.h"
+#include "zstream.h"
+#include "utils.h"
+
+static inline uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+  int p = (int)a + (int)b - (int)c;
+  int pa = std::abs(p - (int)a);
+  int pb = std::abs(p - (int)b);
+  int pc = std::abs(p - (int)c);
+  if (pa <= pb && pa <= pc) return a;
+  if (pb <= pc) return b;
+  return c;
+}
+
+static void filter_row(int type, const uint8_t* cur, const uint8_t* prev, uint8_t* out, size_t n, size_t bpp) {
+  switch (type) {
+  case 0:
+    std::memcpy(out, cur, n);
+    break;
+  case 1:
+    for (size_t i = 0; i < n; ++i) out[i] = static_cast<uint8_t>(cur[i] - (i >= bpp ? cur[i - bpp] : 0));
+    break;
+  case 2:
+    for (size_t i = 0; i < n; ++i) out[i] = static_cast<uint8_t>(cur[i] - prev[i]);
+    break;
+  case 3:
+    for (size_t i = 0; i < n; ++i) out[i] = static_cast<uint8_t>(cur[i] - (((i >= bpp ? cur[i - bpp] : 0) + prev[i]) >> 1));
+    break;
+  case 4:
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = static_cast<uint8_t>(cur[i] - paeth(i >= bpp ? cur[i - bpp] : 0, prev[i], i >= bpp ? prev[i - bpp] : 0));
+    }
+    break;
+  }
+}
+
+// Filtered bytes read as signed; smaller sums tend to deflate better
+static uint64_t row_cost(const uint8_t* row, size_t n) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < n; ++i) sum += row[i] < 128 ? row[i] : 256 - row[i];
+  return sum;
+}
+
+void filter_scanlines(const uint8_t* src, uint8_t* dst, size_t row_bytes, uint32_t height, size_t bpp, PngFilter filter) {
+  const size_t stride = row_bytes + 1;
+  ScratchLease scratch;
+  uint8_t* zero_row = scratch->allocate_array<uint8_t>(row_bytes);
+  uint8_t* trial = filter == PngFilter::Adaptive ? scratch->allocate_array<uint8_t>(row_bytes) : nullptr;
+  std::memset(zero_row, 0, row_bytes);
+
+  for (uint32_t y = 0; y < height; ++y) {
+    const uint8_t* cur = src + y * stride + 1;
+    const uint8_t* prev = y > 0 ? cur - stride : zero_row;
+    uint8_t* out = dst + y * stride + 1;
+
+    int type = static_cast<int>(filter);
+    if (filter == PngFilter::Adaptive) {
+      uint64_t best_cost = UINT64_MAX;
+      for (int t = 0; t < 5; ++t) {
+        filter_row(t, cur, prev, trial, row_bytes, bpp);
+        uint64_t cost = row_cost(trial, row_bytes);
+        if (cost < best_cost) {
+          best_cost = cost;
+          type = t;
+        }
+      }
+    }
+    filter_row(type, cur, prev, out, row_bytes, bpp);
+    out[-1] = static_cast<uint8_t>(type);
+  }
+}
+
+namespace {
+
+struct Candidate {
+  PngFilter filter;
+  bool builtin;
+  DeflateSettings settings;
+};
+
+} // namespace
+
+bool optimize_idat(const uint8_t* scanlines, size_t row_bytes, uint32_t height, size_t bpp,
+  uint32_t time_budget_ms, std::vector<uint8_t>& best) {
+  const auto start = std::chrono::steady_clock::now();
+  const size_t stride = row_bytes + 1;
+  const size_t raw_size = stride * height;
+
+  // Filters and encoder settings, most frequent winners first so a short
+  // budget still covers the likely best.
+  static const PngFilter filters[] = { PngFilter::None, PngFilter::Adaptive, PngFilter::Paeth, PngFilter::Up, PngFilter::Sub, PngFilter::Average };
+  static const int strategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE };
+  // Every filter is tried with plain zlib before any alternative encoder setting,
+  // since the filter choice matters far more
+  std::vector<Candidate> candidates;
+  for (int mem_level : { 9, 8 }) {
+    for (int strategy : strategies) {
+      DeflateSettings s;
+      s.mem_level = mem_level;
+      s.strategy = strategy;
+      for (PngFilter f : filters) {
+        candidates.push_back({ f, false, s });
+      }
+    }
+  }
+  // Smaller windows only change the output when the image is larger than them,
+  // where the shorter match distances occasionally deflate better
+  for (int window_bits : { 14, 12 }) {
+    if ((static_cast<size_t>(1) << window_bits) >= raw_size) {
+      continue;
+    }
+    DeflateSettings s;
+    s.mem_level = 9;
+    s.window_bits = window_bits;
+    for (PngFilter f : filters) {
+      candidates.push_back({ f, false, s });
+    }
+  }
+  for (PngFilter f : filters) {
+    candidates.push_back({ f, true, DeflateSettings() });
+  }
+
+  // Each filtered image is produced once, by whichever worker first needs it
+  ScratchLease scratch;
+  uint8_t* filtered[6] = { nullptr };
+  std::once_flag filtered_once[6];
+  for (auto& p : filtered) {
+    p = scratch->allocate_array<uint8_t>(raw_size);
+    if (!p) {
+      return false;
+    }
+  }
+  auto filtered_for = [&](PngFilter f) {
+    int i = static_cast<int>(f);
+    std::call_once(filtered_once[i], [&] {
+      filter_scanlines(scanlines, filtered[i], row_bytes, height, bpp, f);
+    });
+    return filtered[i];
+  };
+
+  std::mutex best_mutex;
+  size_t best_size = SIZE_MAX;
+  size_t best_index = 0;
+  std::atomic<size_t> next{ 0 };
+  const size_t bound = compressBound(static_cast<uLong>(raw_size));
+
+  auto worker = [&]() {
+    std::vector<uint8_t> buffer(bound);
+    while (true) {
+      size_t i = next++;
+      if (i >= candidates.size()) {
+        return;
+      }
+      if (i > 0 && time_budget_ms != 0 &&
+        std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(time_budget_ms)) {
+        return;
+      }
+
+      const Candidate& c = candidates[i];
+      const uint8_t* data = filtered_for(c.filter);
+      size_t size = bound;
+      bool ok;
+      if (c.builtin) {
+        size = builtin_deflate(data, raw_size, buffer.data(), bound, bpp, stride);
+        ok = size != 0;
+      }
+      else {
+        DeflateStream deflater(c.settings);
+        ok = deflater.compress(data, raw_size, buffer.data(), size);
+      }
+      if (!ok) {
+        continue;
+      }
+
+      std::lock_guard<std::mutex> lock(best_mutex);
+      if (size < best_size || (size == best_size && i < best_index)) {
+        best_size = size;
+        best_index = i;
+        best.assign(buffer.begin(), buffer.begin() + size);
+      }
+    }
+  };
+
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  threads = static_cast<unsigned>(std::min<size_t>(threads, candidates.size()));
+  std::vector<std::thread> pool;
+  for (unsigned t = 1; t < threads; ++t) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (auto& t : pool) {
+    t.join();
+  }
+
+  if (best_size == SIZE_MAX) {
+    std::cerr << "optimize_idat: No candidate could be compressed\n";
+    return false;
+  }
+  const Candidate& won = candidates[best_index];
+  debug_log("optimize_idat: %zu of %zu candidates tried, best %zu bytes (filter %d, %s, strategy %d, memLevel %d, windowBits %d)",
+    std::min(next.load(), candidates.size()), candidates.size(), best_size, static_cast<int>(won.filter),
+    won.builtin ? "builtin" : "zlib", won.settings.strategy, won.settings.mem_level, won.settings.window_bits);
+  return true;
+}
@@ -0,0 +1,496 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <vector>
+#include "output.h"
+#include "utils.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// Direct I/O transfers must be multiples of the device block size at aligned
+// offsets; 4 KiB covers both 512e and 4Kn drives.
+static const size_t kDirectAlignment = 4096;
+static const size_t kDirectBufferSize = 4 * 1024 * 1024;
+
+static std::string make_temp_name(const std::string& filename) {
+  static std::atomic<unsigned> counter{ 0 };
+#ifdef _WIN32
+  unsigned long pid = GetCurrentProcessId();
+#else
+  unsigned long pid = static_cast<unsigned long>(getpid());
+#endif
+  char suffix[64];
+  std::snprintf(suffix, sizeof(suffix), ".tmp%lu_%u", pid, counter++);
+  return filename + suffix;
+}
+
+OutputFile::~OutputFile() {
+  discard();
+}
+
+bool OutputFile::write(const IoSegment* segments, size_t count) {
+  if (!buffer_) {
+    // Buffered mode: hand the segments straight to the OS
+#ifdef _WIN32
+    // WriteFileGather only accepts page-sized unbuffered buffers, so small
+    // segments (element headers) are coalesced with their neighbours instead
+    const size_t kCoalesceLimit = 64 * 1024;
+    std::vector<uint8_t> staging;
+    bool ok = true;
+    for (size_t i = 0; i < count && ok; ++i) {
+      const uint8_t* p = static_cast<const uint8_t*>(segments[i].data);
+      if (segments[i].size < kCoalesceLimit) {
+        staging.insert(staging.end(), p, p + segments[i].size);
+        continue;
+      }
+      if (!staging.empty()) {
+        ok = raw_write(staging.data(), staging.size());
+        staging.clear();
+      }
+      ok = ok && raw_write(p, segments[i].size);
+    }
+    if (ok && !staging.empty()) {
+      ok = raw_write(staging.data(), staging.size());
+    }
+    if (!ok) {
+      return false;
+    }
+    for (size_t i = 0; i < count; ++i) position_ += segments[i].size;
+    return true;
+#else
+    std::vector<iovec> iov(count);
+    for (size_t i = 0; i < count; ++i) {
+      iov[i].iov_base = const_cast<void*>(segments[i].data);
+      iov[i].iov_len = segments[i].size;
+    }
+
+    // writev may stop short; advance through the vector until everything is out
+    size_t first = 0;
+    while (first < count) {
+      int n = static_cast<int>(count - first > IOV_MAX ? IOV_MAX : count - first);
+      ssize_t written = ::writev(fd_, iov.data() + first, n);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        std::cerr << "OutputFile: Write to " << filename_ << " failed: " << std::strerror(errno) << "\n";
+        return false;
+      }
+      position_ += static_cast<uint64_t>(written);
+      while (first < count && static_cast<size_t>(written) >= iov[first].iov_len) {
+        written -= static_cast<ssize_t>(iov[first].iov_len);
+        first++;
+      }
+      if (first < count) {
+        iov[first].iov_base = static_cast<uint8_t*>(iov[first].iov_base) + written;
+        iov[first].iov_len -= static_cast<size_t>(written);
+      }
+    }
+    return true;
+#endif
+  }
+
+  // Direct mode: gather into the aligned staging buffer, flushing whole buffers
+  for (size_t i = 0; i < count; ++i) {
+    const uint8_t* p = static_cast<const uint8_t*>(segments[i].data);
+    size_t left = segments[i].size;
+    while (left > 0) {
+      size_t n = std::min(left, kDirectBufferSize - buffered_);
+      std::memcpy(buffer_ + buffered_, p, n);
+      buffered_ += n;
+      position_ += n;
+      p += n;
+      left -= n;
+      if (buffered_ == kDirectBufferSize && !flush_direct(false)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool OutputFile::write_at(uint64_t offset, const void* data, size_t size) {
+  if (stream_) {
+    std::cerr << "OutputFile: Cannot seek back in standard output\n";
+    return false;
+  }
+  if (offset + size > position_) {
+    std::cerr << "OutputFile: Positional write past the end of " << filename_ << "\n";
+    return false;
+  }
+  if (!buffer_) {
+    return raw_write_at(offset, data, size);
+  }
+
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    if (offset >= flushed_) {
+      // Still staged: patch the buffer
+      std::memcpy(buffer_ + (offset - flushed_), p, size);
+      return true;
+    }
+
+    // Already on disk: read-modify-write the aligned block that holds it
+    uint64_t block = offset / kDirectAlignment * kDirectAlignment;
+    size_t in_block = static_cast<size_t>(offset - block);
+    size_t n = std::min(size, kDirectAlignment - in_block);
+    uint8_t* scratch = static_cast<uint8_t*>(aligned_malloc(kDirectAlignment, kDirectAlignment));
+    bool ok = scratch && raw_read_at(block, scratch, kDirectAlignment);
+    if (ok) {
+      std::memcpy(scratch + in_block, p, n);
+      ok = raw_write_at(block, scratch, kDirectAlignment);
+    }
+    aligned_free(scratch);
+    if (!ok) {
+      return false;
+    }
+    offset += n;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool OutputFile::flush_direct(bool final_block) {
+  if (buffered_ == 0) {
+    return true;
+  }
+
+  // Only the last block may be partial; pad it and trim the file afterwards
+  size_t n = buffered_;
+  if (final_block) {
+    n = (buffered_ + kDirectAlignment - 1) / kDirectAlignment * kDirectAlignment;
+    std::memset(buffer_ + buffered_, 0, n - buffered_);
+  }
+  if (!raw_write_at(flushed_, buffer_, n)) {
+    return false;
+  }
+  flushed_ += buffered_;
+  buffered_ = 0;
+  return !final_block || set_length(flushed_);
+}
+
+bool OutputFile::close() {
+  if (temp_name_.empty()) {
+    return true; // Not open
+  }
+
+  bool ok = !buffer_ || flush_direct(true);
+  ok = ok && (!options_.sync || sync_handle());
+  ok = close_handle() && ok;
+  if (!ok) {
+    discard();
+    return false;
+  }
+
+  if (options_.atomic) {
+#ifdef _WIN32
+    DWORD flags = MOVEFILE_REPLACE_EXISTING | (options_.sync ? MOVEFILE_WRITE_THROUGH : 0);
+    if (!MoveFileExW(utf8_to_wide(temp_name_).c_str(), utf8_to_wide(filename_).c_str(), flags)) {
+      std::cerr << "OutputFile: Failed to replace " << filename_ << " (error " << GetLastError() << ")\n";
+      discard();
+      return false;
+    }
+#else
+    if (std::rename(temp_name_.c_str(), filename_.c_str()) != 0) {
+      std::cerr << "OutputFile: Failed to replace " << filename_ << ": " << std::strerror(errno) << "\n";
+      discard();
+      return false;
+    }
+    if (options_.sync) {
+      // Make the rename itself durable
+      std::string dir = std::filesystem::path(filename_).parent_path().string();
+      int dfd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+      if (dfd >= 0) {
+        ::fsync(dfd);
+        ::close(dfd);
+      }
+    }
+#endif
+  }
+
+  debug_log("OutputFile: Committed %s (%llu bytes)", filename_.c_str(), (unsigned long long)position_);
+  temp_name_.clear();
+  return true;
+}
+
+void OutputFile::discard() {
+  if (temp_name_.empty()) {
+    return;
+  }
+  // Bytes already sent to standard output cannot be taken back
+  const bool remove = !stream_;
+  close_handle();
+  std::error_code ec;
+  if (remove) std::filesystem::remove(temp_name_, ec);
+  temp_name_.clear();
+}
+
+// Standard output is written in place: no temporary file, sync or direct I/O
+bool OutputFile::open_stream() {
+  options_.atomic = false;
+  options_.sync = false;
+  options_.direct_io = false;
+  stream_ = true;
+  temp_name_ = filename_;
+#ifdef _WIN32
+  handle_ = GetStdHandle(STD_OUTPUT_HANDLE);
+  if (!handle_ || handle_ == INVALID_HANDLE_VALUE) {
+    std::cerr << "OutputFile: Standard output is not available\n";
+    handle_ = nullptr;
+    stream_ = false;
+    temp_name_.clear();
+    return false;
+  }
+#else
+  fd_ = STDOUT_FILENO;
+#endif
+  return true;
+}
+
+#ifdef _WIN32
+
+bool OutputFile::open(const std::string& filename, const OutputOptions& options) {
+  discard();
+  filename_ = filename;
+  temp_name_ = options.atomic ? make_temp_name(filename) : filename;
+  options_ = options;
+  position_ = 0;
+  flushed_ = 0;
+  buffered_ = 0;
+  if (is_stdio_path(filename)) {
+    return open_stream();
+  }
+
+  DWORD access = GENERIC_WRITE | (options.direct_io ? GENERIC_READ : 0);
+  DWORD flags = FILE_ATTRIBUTE_NORMAL | (options.direct_io ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN);
+  HANDLE h = CreateFileW(utf8_to_wide(temp_name_).c_str(), access, 0, nullptr, CREATE_ALWAYS, flags, nullptr);
+  if (h == INVALID_HANDLE_VALUE) {
+    std::cerr << "OutputFile: Failed to open " << temp_name_ << " for writing (error " << GetLastError() << ")\n";
+    temp_name_.clear();
+    return false;
+  }
+  handle_ = h;
+
+  if (options.direct_io) {
+    buffer_ = static_cast<uint8_t*>(aligned_malloc(kDirectBufferSize, kDirectAlignment));
+    if (!buffer_) {
+      std::cerr << "OutputFile: Failed to allocate direct I/O buffer\n";
+      discard();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool OutputFile::raw_write(const void* data, size_t size) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    DWORD chunk = size > 0x40000000 ? 0x40000000 : static_cast<DWORD>(size);
+    DWORD written = 0;
+    if (!WriteFile(static_cast<HANDLE>(handle_), p, chunk, &written, nullptr) || written == 0) {
+      std::cerr << "OutputFile: Write to " << filename_ << " failed (error " << GetLastError() << ")\n";
+      return false;
+    }
+    p += written;
+    size -= written;
+  }
+  return true;
+}
+
+bool OutputFile::raw_write_at(uint64_t offset, const void* data, size_t size) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    OVERLAPPED ov{};
+    ov.Offset = static_cast<DWORD>(offset);
+    ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD chunk = size > 0x40000000 ? 0x40000000 : static_cast<DWORD>(size);
+    DWORD written = 0;
+    if (!WriteFile(static_cast<HANDLE>(handle_), p, chunk, &written, &ov) || written == 0) {
+      std::cerr << "OutputFile: Positional write to " << filename_ << " failed (error " << GetLastError() << ")\n";
+      return false;
+    }
+    p += written;
+    offset += written;
+    size -= written;
+  }
+
+  // A positioned WriteFile moves the file pointer; put it back at the end
+  LARGE_INTEGER end;
+  end.QuadPart = static_cast<LONGLONG>(position_);
+  return SetFilePointerEx(static_cast<HANDLE>(handle_), end, nullptr, FILE_BEGIN) != 0;
+}
+
+bool OutputFile::raw_read_at(uint64_t offset, void* data, size_t size) {
+  OVERLAPPED ov{};
+  ov.Offset = static_cast<DWORD>(offset);
+  ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+  DWORD read = 0;
+  if (!ReadFile(static_cast<HANDLE>(handle_), data, static_cast<DWORD>(size), &read, &ov) || read != size) {
+    std::cerr << "OutputFile: Read back from " << filename_ << " failed (error " << GetLastError() << ")\n";
+    return false;
+  }
+  return true;
+}
+
+bool OutputFile::set_length(uint64_t length) {
+  FILE_END_OF_FILE_INFO info;
+  info.EndOfFile.QuadPart = static_cast<LONGLONG>(length);
+  if (!SetFileInformationByHandle(static_cast<HANDLE>(handle_), FileEndOfFileInfo, &info, sizeof(info))) {
+    std::cerr << "OutputFile: Failed to set length of " << filename_ << " (error " << GetLastError() << ")\n";
+    return false;
+  }
+  return true;
+}
+
+bool OutputFile::sync_handle() {
+  if (!FlushFileBuffers(static_cast<HANDLE>(handle_))) {
+    std::cerr << "OutputFile: Failed to flush " << filename_ << " (error " << GetLastError() << ")\n";
+    return false;
+  }
+  return true;
+}
+
+bool OutputFile::close_handle() {
+  // The standard output handle belongs to the process and stays open
+  bool ok = !handle_ || stream_ || CloseHandle(static_cast<HANDLE>(handle_)) != 0;
+  stream_ = false;
+  handle_ = nullptr;
+  aligned_free(buffer_);
+  buffer_ = nullptr;
+  return ok;
+}
+
+#else
+
+bool OutputFile::open(const std::string& filename, const OutputOptions& options) {
+  discard();
+  filename_ = filename;
+  temp_name_ = options.atomic ? make_temp_name(filename) : filename;
+  options_ = options;
+  position_ = 0;
+  flushed_ = 0;
+  buffered_ = 0;
+  if (is_stdio_path(filename)) {
+    return open_stream();
+  }
+
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  bool direct = false;
+#ifdef O_DIRECT
+  if (options.direct_io) {
+    // Read access is needed for read-modify-write of already flushed blocks
+    fd_ = ::open(temp_name_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    direct = fd_ >= 0;
+    if (!direct) {
+      debug_log("OutputFile: O_DIRECT not available for %s (%s), using buffered I/O", temp_name_.c_str(), std::strerror(errno));
+    }
+  }
+#endif
+  if (!direct) {
+    fd_ = ::open(temp_name_.c_str(), flags, 0644);
+  }
+  if (fd_ < 0) {
+    std::cerr << "OutputFile: Failed to open " << temp_name_ << " for writing: " << std::strerror(errno) << "\n";
+    temp_name_.clear();
+    return false;
+  }
+
+  if (direct) {
+    buffer_ = static_cast<uint8_t*>(aligned_malloc(kDirectBufferSize, kDirectAlignment));
+    if (!buffer_) {
+      std::cerr << "OutputFile: Failed to allocate direct I/O buffer\n";
+      discard();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool OutputFile::raw_write(const void* data, size_t size) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    ssize_t written = ::write(fd_, p, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      std::cerr << "OutputFile: Write to " << filename_ << " failed: " << std::strerror(errno) << "\n";
+      return false;
+    }
+    p += written;
+    size -= static_cast<size_t>(written);
+  }
+  return true;
+}
+
+bool OutputFile::raw_write_at(uint64_t offset, const void* data, size_t size) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    ssize_t written = ::pwrite(fd_, p, size, static_cast<off_t>(offset));
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      std::cerr << "OutputFile: Positional write to " << filename_ << " failed: " << std::strerror(errno) << "\n";
+      return false;
+    }
+    p += written;
+    offset += static_cast<uint64_t>(written);
+    size -= static_cast<size_t>(written);
+  }
+  return true;
+}
+
+bool OutputFile::raw_read_at(uint64_t offset, void* data, size_t size) {
+  ssize_t n = ::pread(fd_, data, size, static_cast<off_t>(offset));
+  if (n != static_cast<ssize_t>(size)) {
+    std::cerr << "OutputFile: Read back from " << filename_ << " failed: " << std::strerror(errno) << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool OutputFile::set_length(uint64_t length) {
+  if (::ftruncate(fd_, static_cast<off_t>(length)) != 0) {
+    std::cerr << "OutputFile: Failed to set length of " << filename_ << ": " << std::strerror(errno) << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool OutputFile::sync_handle() {
+  if (::fsync(fd_) != 0) {
+    std::cerr << "OutputFile: Failed to sync " << filename_ << ": " << std::strerror(errno) << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool OutputFile::close_handle() {
+  bool ok = true;
+  if (stream_) {
+    // Standard output belongs to the process and stays open
+    fd_ = -1;
+    stream_ = false;
+  }
+  if (fd_ >= 0 && ::close(fd_) != 0) {
+    // Deferred write errors (e.g. a full network share) can surface here
+    std::cerr << "OutputFile: Closing " << filename_ << " failed: " << std::strerror(errno) << "\n";
+    ok = false;
+  }
+  fd_ = -1;
+  aligned_free(buffer_);
+  buffer_ = nullptr;
+  return ok;
+}
+
+#endif
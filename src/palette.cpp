@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include "palette.h"
+#include "utils.h"
+
+namespace {
+
+inline uint32_t pack_rgba(const Pixel& p) {
+  return static_cast<uint32_t>(p.r) | (static_cast<uint32_t>(p.g) << 8) |
+    (static_cast<uint32_t>(p.b) << 16) | (static_cast<uint32_t>(p.a) << 24);
+}
+
+// Open-addressing set of up to 256 RGBA colours, each mapped to a palette index
+class ColorSet {
+public:
+  static const size_t kMaxColors = 256;
+
+  ColorSet() { std::memset(index_, 0xFF, sizeof(index_)); }
+
+  // Returns the colour's index, adding it if there is room; -1 once full
+  int insert(uint32_t color) {
+    size_t slot = find_slot(color);
+    if (index_[slot] >= 0) {
+      return index_[slot];
+    }
+    if (count_ == kMaxColors) {
+      return -1;
+    }
+    keys_[slot] = color;
+    index_[slot] = static_cast<int16_t>(count_);
+    return static_cast<int>(count_++);
+  }
+
+  int find(uint32_t color) const { return index_[find_slot(color)]; }
+  size_t size() const { return count_; }
+
+private:
+  static const size_t kSlots = 1024; // Power of two, at most a quarter full
+
+  size_t find_slot(uint32_t color) const {
+    size_t slot = (color * 2654435761u) >> 22;
+    while (index_[slot] >= 0 && keys_[slot] != color) {
+      slot = (slot + 1) & (kSlots - 1);
+    }
+    return slot;
+  }
+
+  uint32_t keys_[kSlots];
+  int16_t index_[kSlots];
+  size_t count_ = 0;
+};
+
+// Smallest bit depth (1, 2, 4 or 8) at which grey level v is exact
+inline uint8_t grey_depth(uint8_t v) {
+  if (v % 255 == 0) return 1;
+  if (v % 85 == 0) return 2;
+  if (v % 17 == 0) return 4;
+  return 8;
+}
+
+inline uint8_t palette_depth(size_t colors) {
+  if (colors <= 2) return 1;
+  if (colors <= 4) return 2;
+  if (colors <= 16) return 4;
+  return 8;
+}
+
+int channels(uint8_t color_type) {
+  switch (color_type) {
+  case 0: case 3: return 1;
+  case 4: return 2;
+  case 2: return 3;
+  default: return 4;
+  }
+}
+
+// Raw IDAT input plus the PLTE and tRNS chunks the format needs
+size_t estimated_size(uint32_t width, uint32_t height, const PngFormat& f) {
+  size_t size = (png_row_bytes(width, f) + 1) * height;
+  if (f.color_type == 3) {
+    size += 12 + 3 * f.palette.size();
+    if (f.trns_count > 0) {
+      size += 12 + f.trns_count;
+    }
+  }
+  return size;
+}
+
+} // namespace
+
+size_t png_row_bytes(uint32_t width, const PngFormat& f) {
+  return (static_cast<size_t>(width) * channels(f.color_type) * f.bit_depth + 7) / 8;
+}
+
+size_t png_filter_bpp(const PngFormat& f) {
+  size_t bits = static_cast<size_t>(channels(f.color_type)) * f.bit_depth;
+  return bits < 8 ? 1 : bits / 8;
+}
+
+PngFormat choose_png_format(const ImageView& img) {
+  ColorSet colors;
+  bool fits_palette = true;
+  bool opaque = true;
+  bool grey = true;
+  uint8_t grey_bits = 1;
+
+  for (uint32_t y = 0; y < img.height; ++y) {
+    for (uint32_t x = 0; x < img.width; ++x) {
+      Pixel p = img.pixel(x, y);
+      opaque &= p.a == 255;
+      if (grey) {
+        grey = p.r == p.g && p.g == p.b;
+        grey_bits = std::max(grey_bits, grey_depth(p.r));
+      }
+      if (fits_palette) {
+        fits_palette = colors.insert(pack_rgba(p)) >= 0;
+      }
+    }
+  }
+
+  // Candidates in order of preference on a tie: no PLTE before palette
+  std::vector<PngFormat> candidates;
+  if (grey && opaque) {
+    candidates.push_back({ 0, grey_bits, {}, 0 });
+  }
+  if (grey && !opaque) {
+    candidates.push_back({ 4, 8, {}, 0 });
+  }
+  if (opaque) {
+    candidates.push_back({ 2, 8, {}, 0 });
+  }
+  if (fits_palette) {
+    // Entries are gathered in first-seen order; translucent ones move to the
+    // front so tRNS only covers those
+    PngFormat pal{ 3, palette_depth(colors.size()), std::vector<Pixel>(colors.size()), 0 };
+    for (uint32_t y = 0; y < img.height; ++y) {
+      for (uint32_t x = 0; x < img.width; ++x) {
+        Pixel p = img.pixel(x, y);
+        pal.palette[colors.find(pack_rgba(p))] = p;
+      }
+    }
+    std::stable_partition(pal.palette.begin(), pal.palette.end(), [](const Pixel& p) { return p.a != 255; });
+    pal.trns_count = static_cast<size_t>(std::count_if(pal.palette.begin(), pal.palette.end(),
+      [](const Pixel& p) { return p.a != 255; }));
+    candidates.push_back(std::move(pal));
+  }
+  candidates.push_back({ 6, 8, {}, 0 });
+
+  size_t best = 0;
+  size_t best_size = SIZE_MAX;
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    size_t size = estimated_size(img.width, img.height, candidates[i]);
+    if (size < best_size) {
+      best_size = size;
+      best = i;
+    }
+  }
+
+  const PngFormat& f = candidates[best];
+  debug_log("choose_png_format: %ux%u, %s colours, color_type=%d, bit_depth=%d",
+    img.width, img.height, fits_palette ? std::to_string(colors.size()).c_str() : ">256",
+    (int)f.color_type, (int)f.bit_depth);
+  return f;
+}
+
+bool pack_scanlines(const ImageView& img, const PngFormat& f, uint8_t* dst) {
+  const size_t row_bytes = png_row_bytes(img.width, f);
+  const size_t stride = row_bytes + 1;
+
+  ColorSet indices;
+  for (const Pixel& p : f.palette) {
+    indices.insert(pack_rgba(p));
+  }
+
+  for (uint32_t y = 0; y < img.height; ++y) {
+    uint8_t* out = dst + y * stride;
+    *out++ = 0; // Filter byte 0 (None)
+
+    if (f.bit_depth < 8) {
+      // Grey levels or palette indices packed most significant bits first
+      std::memset(out, 0, row_bytes);
+      const int depth = f.bit_depth;
+      const int scale = 255 / ((1 << depth) - 1);
+      for (uint32_t x = 0; x < img.width; ++x) {
+        Pixel p = img.pixel(x, y);
+        int v = f.color_type == 3 ? indices.find(pack_rgba(p)) : p.r / scale;
+        if (v < 0) {
+          return false;
+        }
+        size_t bit = static_cast<size_t>(x) * depth;
+        out[bit / 8] |= static_cast<uint8_t>(v << (8 - depth - bit % 8));
+      }
+      continue;
+    }
+
+    for (uint32_t x = 0; x < img.width; ++x) {
+      Pixel p = img.pixel(x, y);
+      switch (f.color_type) {
+      case 0:
+        *out++ = p.r;
+        break;
+      case 2:
+        *out++ = p.r; *out++ = p.g; *out++ = p.b;
+        break;
+      case 3: {
+        int v = indices.find(pack_rgba(p));
+        if (v < 0) {
+          return false;
+        }
+        *out++ = static_cast<uint8_t>(v);
+        break;
+      }
+      case 4:
+        *out++ = p.r; *out++ = p.a;
+        break;
+      default:
+        *out++ = p.r; *out++ = p.g; *out++ = p.b; *out++ = p.a;
+        break;
+      }
+    }
+  }
+  return true;
+}
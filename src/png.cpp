@@ -10,25 +10,31 @@
 
 #include "crc.h"
 #include "utils.h"
+#include "mapped_file.h"
+#include "arena.h"
+#include "zstream.h"
+#include "deflate.h"
+#include "optimize.h"
+#include "palette.h"
 #include <resize.h>
 #include <png.h>
 
-static void write_be32(std::ostream& out, uint32_t val) {
-  out.put((val >> 24) & 0xFF);
-  out.put((val >> 16) & 0xFF);
-  out.put((val >> 8) & 0xFF);
-  out.put(val & 0xFF);
+static void write_be32(std::vector<uint8_t>& out, uint32_t val) {
+  out.push_back((val >> 24) & 0xFF);
+  out.push_back((val >> 16) & 0xFF);
+  out.push_back((val >> 8) & 0xFF);
+  out.push_back(val & 0xFF);
 }
 
-static void write_chunk(std::ostream& out, const char* type, const std::vector<uint8_t>& data) {
+static void write_chunk(std::vector<uint8_t>& out, const char* type, const std::vector<uint8_t>& data) {
   write_be32(out, static_cast<uint32_t>(data.size()));
 
   std::array<uint8_t, 4> chunk_type;
   std::memcpy(chunk_type.data(), type, 4);
-  out.write(reinterpret_cast<const char*>(chunk_type.data()), 4);
+  out.insert(out.end(), chunk_type.begin(), chunk_type.end());
 
   if (!data.empty())
-    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+    out.insert(out.end(), data.begin(), data.end());
 
   uint32_t crc = crc32(0, nullptr, 0);
   crc = crc32(crc, chunk_type.data(), 4);
@@ -38,16 +44,27 @@ static void write_chunk(std::ostream& out, const char* type, const std::vector<u
   write_be32(out, crc);
 }
 
-bool write_png(const std::string& filename, const std::vector<Pixel>& pixels, int width, int height) {
-  std::ofstream out(filename, std::ios::binary);
-  if (!out) {
-    std::cerr << "write_png: Failed to open " << filename << " for writing\n";
-    return false;
-  }
+uint32_t png_options_key(const PNGOptions& options) {
+  uint32_t key = options.optimize ? 2 : (options.deflate == DeflateBackend::Builtin ? 1 : 0);
+  return options.reduce ? key : key | 4;
+}
+
+bool encode_png(const ImageView& img, std::vector<uint8_t>& out, const PNGOptions& options) {
+  const uint32_t width = img.width;
+  const uint32_t height = img.height;
+
+  // Palette, grey or RGB output whenever that still holds every pixel exactly
+  const PngFormat format = options.reduce ? choose_png_format(img) : PngFormat();
+  const size_t bpp = png_filter_bpp(format);
 
   // PNG signature
   const uint8_t png_sig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
-  out.write(reinterpret_cast<const char*>(png_sig), 8);
+  out.assign(png_sig, png_sig + 8);
+
+  // Signature, IHDR, PLTE/tRNS, IDAT header/CRC and IEND around the worst-case
+  // deflate size, so the output never reallocates
+  const size_t scanline_stride = png_row_bytes(width, format) + 1;
+  out.reserve(8 + 25 + (12 + 3 * 256) + (12 + 256) + 12 + compressBound(static_cast<uLong>(scanline_stride * height)) + 12);
 
   // IHDR chunk (13 bytes)
   std::vector<uint8_t> ihdr(13);
@@ -61,46 +78,128 @@ bool write_png(const std::string& filename, const std::vector<Pixel>& pixels, in
   ihdr[6] = (height >> 8) & 0xFF;
   ihdr[7] = height & 0xFF;
 
-  ihdr[8] = 8;    // Bit depth (8 bits per channel)
-  ihdr[9] = 6;    // Color type RGBA (6 = Truecolor with alpha)
+  ihdr[8] = format.bit_depth;   // Bit depth per channel (or per palette index)
+  ihdr[9] = format.color_type;  // Color type (6 = Truecolor with alpha)
   ihdr[10] = 0;   // Compression method (deflate)
   ihdr[11] = 0;   // Filter method (adaptive filtering with five basic filter types)
   ihdr[12] = 0;   // Interlace method (None)
 
   write_chunk(out, "IHDR", ihdr);
 
-  // Prepare raw image data with filter bytes (filter 0: None)
-  std::vector<uint8_t> raw_image_data_with_filters;
-  raw_image_data_with_filters.reserve((width * 4 + 1) * height);
-  for (int y = 0; y < height; ++y) {
-    raw_image_data_with_filters.push_back(0); // Filter byte 0 (None) for each scanline
-    for (int x = 0; x < width; ++x) {
-      const Pixel& p = pixels[y * width + x];
-      raw_image_data_with_filters.push_back(p.r);
-      raw_image_data_with_filters.push_back(p.g);
-      raw_image_data_with_filters.push_back(p.b);
-      raw_image_data_with_filters.push_back(p.a);
+  if (format.color_type == 3) {
+    std::vector<uint8_t> plte;
+    plte.reserve(format.palette.size() * 3);
+    for (const Pixel& p : format.palette) {
+      plte.insert(plte.end(), { p.r, p.g, p.b });
+    }
+    write_chunk(out, "PLTE", plte);
+
+    // Translucent entries are sorted first, so tRNS stops at the last of them
+    if (format.trns_count > 0) {
+      std::vector<uint8_t> trns(format.trns_count);
+      for (size_t i = 0; i < trns.size(); ++i) {
+        trns[i] = format.palette[i].a;
+      }
+      write_chunk(out, "tRNS", trns);
     }
   }
 
-  // Compress with zlib
-  uLongf compressed_size = compressBound(raw_image_data_with_filters.size());
-  std::vector<uint8_t> compressed_data(compressed_size);
-  int ret = compress2(compressed_data.data(), &compressed_size,
-    raw_image_data_with_filters.data(), raw_image_data_with_filters.size(),
-    Z_BEST_COMPRESSION);
-  if (ret != Z_OK) {
-    std::cerr << "write_png: zlib compress failed with code " << ret << "\n";
+  // Prepare raw image data with filter bytes (filter 0: None). For RGBA the
+  // scanlines are an interleaved view offset by one byte, so rows are copied
+  // (or interleaved from planar input) directly into place.
+  ScratchLease scratch;
+  const size_t raw_size = scanline_stride * height;
+  uint8_t* raw_image_data_with_filters = scratch->allocate_array<uint8_t>(raw_size);
+  if (!raw_image_data_with_filters) {
+    return false;
+  }
+  if (format.color_type == 6) {
+    for (uint32_t y = 0; y < height; ++y) {
+      raw_image_data_with_filters[y * scanline_stride] = 0; // Filter byte 0 (None) for each scanline
+    }
+    ImageView scanlines;
+    scanlines.layout = PixelLayout::Interleaved;
+    scanlines.width = width;
+    scanlines.height = height;
+    scanlines.stride = scanline_stride;
+    scanlines.planes[0] = raw_image_data_with_filters + 1;
+    convert_layout(img, scanlines);
+  }
+  else if (!pack_scanlines(img, format, raw_image_data_with_filters)) {
+    std::cerr << "encode_png: Failed to pack scanlines for color type " << (int)format.color_type << "\n";
     return false;
   }
-  compressed_data.resize(compressed_size);
 
-  write_chunk(out, "IDAT", compressed_data);
+  if (options.optimize) {
+    std::vector<uint8_t> best;
+    if (!optimize_idat(raw_image_data_with_filters, scanline_stride - 1, height, bpp, options.optimize_budget_ms, best)) {
+      return false;
+    }
+    write_chunk(out, "IDAT", best);
+    write_chunk(out, "IEND", {});
+    return true;
+  }
+
+  // Compress with zlib straight into the IDAT chunk body, then patch its length and CRC
+  // (same settings as compress2, on a pooled stream that is reset rather than rebuilt)
+  const size_t idat_pos = out.size();
+  size_t compressed_size = compressBound(static_cast<uLong>(raw_size));
+  out.resize(idat_pos + 8 + compressed_size + 4);
+
+  if (options.deflate == DeflateBackend::Builtin) {
+    compressed_size = builtin_deflate(raw_image_data_with_filters, raw_size, out.data() + idat_pos + 8, compressed_size, bpp, scanline_stride);
+    if (compressed_size == 0) {
+      std::cerr << "encode_png: builtin deflate failed\n";
+      return false;
+    }
+  }
+  else {
+    DeflateStream deflater;
+    if (!deflater.compress(raw_image_data_with_filters, raw_size, out.data() + idat_pos + 8, compressed_size)) {
+      std::cerr << "encode_png: zlib compress failed\n";
+      return false;
+    }
+  }
+  uint8_t* idat = out.data() + idat_pos;
+  write_be_uint32(idat, static_cast<uint32_t>(compressed_size));
+  std::memcpy(idat + 4, "IDAT", 4);
+  write_be_uint32(idat + 8 + compressed_size, crc32(crc32(0, nullptr, 0), idat + 4, static_cast<uInt>(compressed_size + 4)));
+  out.resize(idat_pos + 8 + compressed_size + 4);
+
   write_chunk(out, "IEND", {});
 
   return true;
 }
 
+bool encode_png(const std::vector<Pixel>& pixels, int width, int height, std::vector<uint8_t>& out) {
+  return encode_png(ImageView::interleaved(pixels.data(), width, height), out);
+}
+
+bool write_png(const std::string& filename, const ImageView& img) {
+  std::vector<uint8_t> pngdata;
+  if (!encode_png(img, pngdata)) {
+    return false;
+  }
+
+  std::ofstream out(filename, std::ios::binary);
+  if (!out) {
+    std::cerr << "write_png: Failed to open " << filename << " for writing\n";
+    return false;
+  }
+
+  out.write(reinterpret_cast<const char*>(pngdata.data()), pngdata.size());
+  if (!out) {
+    std::cerr << "write_png: Failed to write " << filename << "\n";
+    return false;
+  }
+
+  return true;
+}
+
+bool write_png(const std::string& filename, const std::vector<Pixel>& pixels, int width, int height) {
+  return write_png(filename, ImageView::interleaved(pixels.data(), width, height));
+}
+
 static uint8_t paeth_predictor(uint8_t a, uint8_t b, uint8_t c) {
   // a = left, b = above, c = upper-left
   int p = (int)a + (int)b - (int)c;
@@ -114,65 +213,166 @@ static uint8_t paeth_predictor(uint8_t a, uint8_t b, uint8_t c) {
 }
 
 
-bool load_simple_png(const std::string& filename, PNGImage& out) {
-  std::ifstream f(filename, std::ios::binary);
-  if (!f.is_open()) {
-    std::cerr << "load_simple_png: Failed to open " << filename << "\n";
+bool png_dimensions(const uint8_t* data, size_t size, uint32_t& width, uint32_t& height) {
+  // Signature, then IHDR must be the first chunk
+  if (size < 33 || std::memcmp(data, "\x89PNG\r\n\x1a\n", 8) != 0 || std::memcmp(data + 12, "IHDR", 4) != 0) {
     return false;
   }
+  width = read_be_uint32(data + 16);
+  height = read_be_uint32(data + 20);
+  if (static_cast<uint64_t>(width) * height > kMaxPngPixels) {
+    std::cerr << "png_dimensions: " << width << "x" << height << " exceeds the " << kMaxPngPixels << " pixel limit\n";
+    return false;
+  }
+  return width != 0 && height != 0;
+}
 
-  // Read signature
-  uint8_t sig[8];
-  f.read(reinterpret_cast<char*>(sig), 8);
-  if (!f || std::memcmp(sig, "\x89PNG\r\n\x1a\n", 8) != 0) {
-    std::cerr << "load_simple_png: Invalid PNG signature in " << filename << "\n";
+// Reverses PNG filtering in place. data holds height scanlines of one filter
+// byte followed by row_bytes filtered bytes; bpp is the filter's pixel distance.
+static bool unfilter_scanlines(uint8_t* data, uint32_t height, size_t row_bytes, size_t bpp, ScratchArena& scratch) {
+  const size_t stride = row_bytes + 1;
+  uint8_t* zero_row = scratch.allocate_array<uint8_t>(row_bytes); // "Previous" row for the first scanline
+  if (!zero_row) {
+    return false;
+  }
+  std::memset(zero_row, 0, row_bytes);
+
+  for (uint32_t y = 0; y < height; ++y) {
+    uint8_t filter_type = data[y * stride];
+    uint8_t* cur = data + y * stride + 1;
+    const uint8_t* prev = y > 0 ? cur - stride : zero_row;
+
+    switch (filter_type) {
+    case 0: // None
+      break;
+    case 1: // Sub
+      for (size_t i = bpp; i < row_bytes; ++i) cur[i] += cur[i - bpp];
+      break;
+    case 2: // Up
+      for (size_t i = 0; i < row_bytes; ++i) cur[i] += prev[i];
+      break;
+    case 3: // Average
+      for (size_t i = 0; i < bpp && i < row_bytes; ++i) cur[i] += prev[i] / 2;
+      for (size_t i = bpp; i < row_bytes; ++i) cur[i] += (uint8_t)((cur[i - bpp] + prev[i]) / 2);
+      break;
+    case 4: // Paeth
+      for (size_t i = 0; i < bpp && i < row_bytes; ++i) cur[i] += paeth_predictor(0, prev[i], 0);
+      for (size_t i = bpp; i < row_bytes; ++i) cur[i] += paeth_predictor(cur[i - bpp], prev[i], prev[i - bpp]);
+      break;
+    default:
+      debug_log("Unsupported filter type %d found for scanline %u", (int)filter_type, y);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Colour type, bit depth and the PLTE/tRNS data needed to expand a scanline to RGBA
+struct PngSource {
+  PngFormat format;
+  Pixel palette[256];
+  bool has_key = false; // tRNS colour key for grey and RGB images
+  uint16_t key[3] = { 0, 0, 0 };
+};
+
+static bool supported_format(uint8_t color_type, uint8_t bit_depth) {
+  switch (color_type) {
+  case 0: return bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8 || bit_depth == 16;
+  case 3: return bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8;
+  case 2: case 4: case 6: return bit_depth == 8 || bit_depth == 16;
+  default: return false;
+  }
+}
+
+// Expands one unfiltered scanline of any colour type and depth to RGBA
+static void expand_row(const uint8_t* src, uint8_t* out, uint32_t width, const PngSource& s) {
+  const int depth = s.format.bit_depth;
+  auto sample = [&](size_t i) -> uint16_t {
+    if (depth == 16) return static_cast<uint16_t>((src[2 * i] << 8) | src[2 * i + 1]);
+    if (depth == 8) return src[i];
+    size_t bit = i * depth;
+    return (src[bit / 8] >> (8 - depth - bit % 8)) & ((1 << depth) - 1);
+  };
+  auto to8 = [&](uint16_t v) -> uint8_t {
+    if (depth == 16) return static_cast<uint8_t>(v >> 8);
+    if (depth == 8) return static_cast<uint8_t>(v);
+    return static_cast<uint8_t>(v * 255 / ((1 << depth) - 1));
+  };
+
+  for (uint32_t x = 0; x < width; ++x, out += 4) {
+    switch (s.format.color_type) {
+    case 0: {
+      uint16_t g = sample(x);
+      out[0] = out[1] = out[2] = to8(g);
+      out[3] = s.has_key && g == s.key[0] ? 0 : 255;
+      break;
+    }
+    case 2: {
+      uint16_t r = sample(3 * x), g = sample(3 * x + 1), b = sample(3 * x + 2);
+      out[0] = to8(r); out[1] = to8(g); out[2] = to8(b);
+      out[3] = s.has_key && r == s.key[0] && g == s.key[1] && b == s.key[2] ? 0 : 255;
+      break;
+    }
+    case 3: {
+      const Pixel& p = s.palette[sample(x)];
+      out[0] = p.r; out[1] = p.g; out[2] = p.b; out[3] = p.a;
+      break;
+    }
+    case 4:
+      out[0] = out[1] = out[2] = to8(sample(2 * x));
+      out[3] = to8(sample(2 * x + 1));
+      break;
+    default:
+      for (int c = 0; c < 4; ++c) out[c] = to8(sample(4 * x + c));
+      break;
+    }
+  }
+}
+
+bool decode_png(const uint8_t* data, size_t size, const ImageView& dst, const std::string& filename) {
+  // Check signature
+  if (size < 8 || std::memcmp(data, "\x89PNG\r\n\x1a\n", 8) != 0) {
+    std::cerr << "decode_png: Invalid PNG signature in " << filename << "\n";
     return false;
   }
 
   uint32_t width = 0, height = 0;
   uint8_t color_type = 0, bit_depth = 0, interlace = 0;
   bool found_ihdr = false;
-  std::vector<uint8_t> idat_data;
+  PngSource source;
+  bool found_plte = false;
+  for (Pixel& p : source.palette) {
+    p = Pixel{ 0, 0, 0, 255 }; // Indices past the PLTE decode as opaque black
+  }
+  const uint8_t* idat_ptr = nullptr; // First IDAT payload, used in place when it is the only one
+  size_t idat_size = 0;
+  size_t idat_count = 0;
 
-  // Read chunks
+  // Walk chunks in place; nothing is copied except when IDATs must be joined
+  size_t pos = 8;
   while (true) {
-    uint8_t len_buf[4];
-    if (!f.read(reinterpret_cast<char*>(len_buf), 4)) {
-      if (f.eof()) {
-        debug_log ("Reached EOF while reading chunk length. Exiting chunk reading loop.");
-        break; // Reached end of file unexpectedly early, but can be normal for IEND
-      }
-      std::cerr << "load_simple_png: Failed to read chunk length in " << filename << "\n";
-      return false;
+    if (size - pos < 8) {
+      debug_log("Reached end of data while reading chunk header. Exiting chunk reading loop.");
+      break; // Ran out of data before IEND; decode what was found
     }
-    uint32_t len = (len_buf[0] << 24) | (len_buf[1] << 16) | (len_buf[2] << 8) | len_buf[3];
+    uint32_t len = (data[pos] << 24) | (data[pos + 1] << 16) | (data[pos + 2] << 8) | data[pos + 3];
 
     char type[5] = { 0 };
-    if (!f.read(type, 4)) {
-      std::cerr << "load_simple_png: Failed to read chunk type in " << filename << "\n";
-      return false;
-    }
+    std::memcpy(type, data + pos + 4, 4);
 
     debug_log("Reading chunk type: %s, length: %u", type, len);
 
-    std::vector<uint8_t> chunk(len);
-    if (len > 0) {
-      if (!f.read(reinterpret_cast<char*>(chunk.data()), len)) {
-        std::cerr << "load_simple_png: Failed to read chunk data in " << filename << "\n";
-        return false;
-      }
-    }
-
-    // Read and discard CRC (4 bytes)
-    f.seekg(4, std::ios::cur);
-    if (!f) {
-      std::cerr << "load_simple_png: Failed to skip CRC in " << filename << "\n";
+    // Chunk data plus 4 bytes of CRC (not verified)
+    if (size - pos - 8 < static_cast<size_t>(len) + 4) {
+      std::cerr << "decode_png: Truncated chunk " << type << " in " << filename << "\n";
       return false;
     }
+    const uint8_t* chunk = data + pos + 8;
+    pos += 12 + static_cast<size_t>(len);
 
     if (std::strcmp(type, "IHDR") == 0) {
       if (len != 13) {
-        std::cerr << "load_simple_png: Invalid IHDR length in " << filename << "\n";
+        std::cerr << "decode_png: Invalid IHDR length in " << filename << "\n";
         return false;
       }
       width = (chunk[0] << 24) | (chunk[1] << 16) | (chunk[2] << 8) | chunk[3];
@@ -184,179 +384,216 @@ bool load_simple_png(const std::string& filename, PNGImage& out) {
       debug_log("IHDR: width=%u, height=%u, bit_depth=%d, color_type=%d, interlace=%d",
         width, height, (int)bit_depth, (int)color_type, (int)interlace);
 
-      // Only support 8-bit RGBA (color type 6) and no interlacing for this simple loader
-      if (color_type != 6 || bit_depth != 8 || interlace != 0) {
-        std::cerr << "load_simple_png: Unsupported format (color_type=" << (int)color_type
+      if (static_cast<uint64_t>(width) * height > kMaxPngPixels) {
+        std::cerr << "decode_png: " << width << "x" << height << " exceeds the pixel limit in " << filename << "\n";
+        return false;
+      }
+
+      // Every colour type and depth is expanded to RGBA; interlacing is not supported
+      if (!supported_format(color_type, bit_depth) || interlace != 0) {
+        std::cerr << "decode_png: Unsupported format (color_type=" << (int)color_type
           << ", bit_depth=" << (int)bit_depth << ", interlace=" << (int)interlace
-          << ") in " << filename << ". Only 8-bit RGBA non-interlaced supported.\n";
+          << ") in " << filename << ". Only non-interlaced images are supported.\n";
+        return false;
+      }
+      source.format.color_type = color_type;
+      source.format.bit_depth = bit_depth;
+      if (width != dst.width || height != dst.height) {
+        std::cerr << "decode_png: Destination is " << dst.width << "x" << dst.height
+          << " but " << filename << " is " << width << "x" << height << "\n";
         return false;
       }
       found_ihdr = true;
     }
     else if (std::strcmp(type, "IDAT") == 0) {
-      idat_data.insert(idat_data.end(), chunk.begin(), chunk.end());
-      debug_log("Appended IDAT chunk. Total IDAT size: %zu", idat_data.size());
+      if (idat_count++ == 0) {
+        idat_ptr = chunk;
+      }
+      idat_size += len;
+      debug_log("Found IDAT chunk. Total IDAT size: %zu", idat_size);
+    }
+    else if (std::strcmp(type, "PLTE") == 0) {
+      for (uint32_t i = 0; i < len / 3 && i < 256; ++i) {
+        source.palette[i].r = chunk[3 * i];
+        source.palette[i].g = chunk[3 * i + 1];
+        source.palette[i].b = chunk[3 * i + 2];
+      }
+      found_plte = true;
+    }
+    else if (std::strcmp(type, "tRNS") == 0) {
+      if (color_type == 3) {
+        for (uint32_t i = 0; i < len && i < 256; ++i) {
+          source.palette[i].a = chunk[i];
+        }
+      }
+      else if ((color_type == 0 && len >= 2) || (color_type == 2 && len >= 6)) {
+        for (uint32_t c = 0; c < (color_type == 0 ? 1u : 3u); ++c) {
+          source.key[c] = static_cast<uint16_t>((chunk[2 * c] << 8) | chunk[2 * c + 1]);
+        }
+        source.has_key = true;
+      }
     }
     else if (std::strcmp(type, "IEND") == 0) {
       debug_log("Found IEND chunk. Breaking chunk reading loop.");
       break; // End of PNG
     }
-    // Other chunks (PLTE, tRNS, gAMA, etc.) are ignored for simplicity
+    // Other chunks (gAMA, iCCP, etc.) are ignored for simplicity
   }
 
   if (!found_ihdr) {
-    std::cerr << "load_simple_png: Missing IHDR chunk in " << filename << "\n";
+    std::cerr << "decode_png: Missing IHDR chunk in " << filename << "\n";
+    return false;
+  }
+  if (idat_size == 0) {
+    std::cerr << "decode_png: No IDAT data in " << filename << "\n";
     return false;
   }
-  if (idat_data.empty()) {
-    std::cerr << "load_simple_png: No IDAT data in " << filename << "\n";
+  if (color_type == 3 && !found_plte) {
+    std::cerr << "decode_png: Missing PLTE chunk in " << filename << "\n";
     return false;
   }
 
-  // Decompress IDAT data using zlib
-  z_stream strm{};
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  strm.avail_in = static_cast<uInt>(idat_data.size());
-  strm.next_in = idat_data.data();
+  ScratchLease scratch;
 
-  // Initialize zlib for inflation (decompression)
-  if (inflateInit(&strm) != Z_OK) {
-    std::cerr << "load_simple_png: zlib inflateInit failed for " << filename << "\n";
+  // Several IDATs are joined into one scratch buffer with a second walk over the
+  // chunks (already validated above); a single IDAT is inflated in place
+  const uint8_t* idat = idat_ptr;
+  if (idat_count > 1) {
+    uint8_t* joined = scratch->allocate_array<uint8_t>(idat_size);
+    if (!joined) {
+      return false;
+    }
+    size_t joined_size = 0;
+    for (size_t p = static_cast<size_t>(idat_ptr - data) - 8; joined_size < idat_size; ) {
+      uint32_t len = read_be_uint32(data + p);
+      if (std::memcmp(data + p + 4, "IDAT", 4) == 0) {
+        std::memcpy(joined + joined_size, data + p + 8, len);
+        joined_size += len;
+      }
+      p += 12 + static_cast<size_t>(len);
+    }
+    idat = joined;
+  }
+
+  // Decompress IDAT data using a pooled zlib stream
+  InflateStream inflater;
+  if (!inflater.ok()) {
+    std::cerr << "decode_png: zlib inflateInit failed for " << filename << "\n";
     return false;
   }
+  z_stream& strm = *inflater.get();
+  strm.avail_in = static_cast<uInt>(idat_size);
+  strm.next_in = const_cast<uint8_t*>(idat);
 
-  // Expected size of decompressed data: (filter_byte + width * bytes_per_pixel) * height
-  const int bytes_per_pixel = 4; // RGBA
-  const size_t scanline_stride = 1 + width * bytes_per_pixel; // 1 for filter byte + pixel data
+  // Expected size of decompressed data: (filter_byte + packed row) * height
+  const size_t bytes_per_pixel = png_filter_bpp(source.format);
+  const size_t scanline_stride = 1 + png_row_bytes(width, source.format); // 1 for filter byte + pixel data
   const size_t expected_decompressed_size = static_cast<size_t>(height) * scanline_stride;
-  std::vector<uint8_t> decompressed_data;
-  decompressed_data.reserve(expected_decompressed_size); // Pre-allocate to reduce reallocations
 
-  std::vector<uint8_t> buffer(16384); // Buffer for zlib to write into
-  int ret = Z_OK;
-  do {
-    strm.avail_out = static_cast<uInt>(buffer.size());
-    strm.next_out = buffer.data();
+  // Inflate straight into a buffer of the exact final size
+  uint8_t* decompressed_data = scratch->allocate_array<uint8_t>(expected_decompressed_size);
+  if (!decompressed_data) {
+    return false;
+  }
+  strm.next_out = decompressed_data;
+  strm.avail_out = static_cast<uInt>(expected_decompressed_size);
+  int ret = inflate(&strm, Z_FINISH);
+  size_t produced = expected_decompressed_size - strm.avail_out;
+  const char* msg = strm.msg;
+
+  // Z_BUF_ERROR with a full buffer only means trailing data past the last scanline
+  if (ret != Z_STREAM_END && !(ret == Z_BUF_ERROR && strm.avail_out == 0)) {
+    if (ret == Z_BUF_ERROR) {
+      std::cerr << "decode_png: Decompressed data too short: " << produced << " < " << expected_decompressed_size << " for " << filename << "\n";
+    }
+    else {
+      std::cerr << "decode_png: zlib inflate error (ret=" << ret << ", msg=" << (msg ? msg : "unknown") << ") for " << filename << "\n";
+    }
+    return false;
+  }
+  if (produced < expected_decompressed_size) {
+    std::cerr << "decode_png: Decompressed data too short: " << produced << " < " << expected_decompressed_size << " for " << filename << "\n";
+    return false;
+  }
+
+  debug_log("Decompressed data size: %zu, expected: %zu", produced, expected_decompressed_size);
 
-    ret = inflate(&strm, Z_NO_FLUSH); // Inflate data
+  if (!unfilter_scanlines(decompressed_data, height, scanline_stride - 1, bytes_per_pixel, scratch.arena())) {
+    std::cerr << "decode_png: Unsupported filter type found in " << filename << "\n";
+    return false;
+  }
 
-    if (ret != Z_OK && ret != Z_STREAM_END) {
-      inflateEnd(&strm);
-      std::cerr << "load_simple_png: zlib inflate error (ret=" << ret << ", msg=" << (strm.msg ? strm.msg : "unknown") << ") for " << filename << "\n";
+  if (color_type == 6 && bit_depth == 8) {
+    // The unfiltered scanlines are an interleaved view one byte past each filter byte
+    ImageView scanlines;
+    scanlines.layout = PixelLayout::Interleaved;
+    scanlines.width = width;
+    scanlines.height = height;
+    scanlines.stride = scanline_stride;
+    scanlines.planes[0] = decompressed_data + 1;
+    convert_layout(scanlines, dst);
+  }
+  else {
+    // Other formats expand to RGBA, straight into interleaved destinations
+    ImageView rgba = dst.layout == PixelLayout::Interleaved ? dst : scratch->allocate_image(width, height, PixelLayout::Interleaved);
+    if (!rgba.planes[0]) {
       return false;
     }
+    for (uint32_t y = 0; y < height; ++y) {
+      expand_row(decompressed_data + y * scanline_stride + 1, rgba.row(y), width, source);
+    }
+    if (rgba.planes[0] != dst.planes[0]) {
+      convert_layout(rgba, dst);
+    }
+  }
 
-    size_t have = buffer.size() - strm.avail_out;
-    decompressed_data.insert(decompressed_data.end(), buffer.begin(), buffer.begin() + have);
-
-  } while (ret != Z_STREAM_END);
+  debug_log("Loaded PNG %s (%ux%u)", filename.c_str(), width, height);
 
-  inflateEnd(&strm); // Clean up zlib stream
+  return true;
+}
 
-  if (decompressed_data.size() < expected_decompressed_size) {
-    std::cerr << "load_simple_png: Decompressed data too short: " << decompressed_data.size() << " < " << expected_decompressed_size << " for " << filename << "\n";
+bool decode_png(const uint8_t* data, size_t size, PNGImage& out, const std::string& filename) {
+  uint32_t width = 0, height = 0;
+  if (!png_dimensions(data, size, width, height)) {
+    std::cerr << "decode_png: Invalid PNG header in " << filename << "\n";
     return false;
   }
 
-  debug_log("Decompressed data size: %zu, expected: %zu", decompressed_data.size(), expected_decompressed_size);
-
   out.width = width;
   out.height = height;
-  out.pixels.resize(width * height);
-
-  // Buffer to hold the unfiltered bytes of the *previous* scanline, initialized to all zeros
-  std::vector<uint8_t> prev_scanline_raw_bytes(width * bytes_per_pixel, 0);
-
-  const uint8_t* current_decompressed_ptr = decompressed_data.data();
-
-  for (uint32_t y = 0; y < height; ++y) {
-    uint8_t filter_type = *current_decompressed_ptr++; // Read filter byte
-
-    // Temporary buffer to store the unfiltered bytes of the *current* scanline
-    std::vector<uint8_t> current_scanline_raw_bytes(width * bytes_per_pixel);
-
-    for (int i = 0; i < width * bytes_per_pixel; ++i) {
-      uint8_t filtered_byte = *current_decompressed_ptr++; // Read the filtered pixel byte
-
-      // Get predicted values (a=left, b=above, c=upper-left)
-      uint8_t a = (i >= bytes_per_pixel) ? current_scanline_raw_bytes[i - bytes_per_pixel] : 0;
-      uint8_t b = prev_scanline_raw_bytes[i];
-      uint8_t c = (i >= bytes_per_pixel) ? prev_scanline_raw_bytes[i - bytes_per_pixel] : 0;
-
-      uint8_t unfiltered_byte;
-
-      // Apply unfiltering based on filter type
-      switch (filter_type) {
-      case 0: // None
-        unfiltered_byte = filtered_byte;
-        break;
-      case 1: // Sub
-        unfiltered_byte = filtered_byte + a;
-        break;
-      case 2: // Up
-        unfiltered_byte = filtered_byte + b;
-        break;
-      case 3: // Average
-        unfiltered_byte = filtered_byte + (uint8_t)((a + b) / 2);
-        break;
-      case 4: // Paeth
-        unfiltered_byte = filtered_byte + paeth_predictor(a, b, c);
-        break;
-      default:
-        std::cerr << "load_simple_png: Unsupported filter type " << (int)filter_type << " found for scanline " << y << " in " << filename << "\n";
-        return false;
-      }
-      current_scanline_raw_bytes[i] = unfiltered_byte;
-    }
-
-    // Copy unfiltered bytes to the Pixel struct vector
-    for (uint32_t x = 0; x < width; ++x) {
-      size_t pixel_idx = y * width + x;
-      size_t byte_offset = x * bytes_per_pixel;
-      Pixel& px = out.pixels[pixel_idx];
-      px.r = current_scanline_raw_bytes[byte_offset];
-      px.g = current_scanline_raw_bytes[byte_offset + 1];
-      px.b = current_scanline_raw_bytes[byte_offset + 2];
-      px.a = current_scanline_raw_bytes[byte_offset + 3];
-    }
+  out.pixels.resize(static_cast<size_t>(width) * height);
+  return decode_png(data, size, ImageView::interleaved(out.pixels.data(), width, height), filename);
+}
 
-    // The current scanline becomes the previous scanline for the next iteration
-    prev_scanline_raw_bytes = current_scanline_raw_bytes;
+bool load_simple_png(const std::string& filename, PNGImage& out) {
+  MappedFile file;
+  if (!file.open(filename)) {
+    std::cerr << "load_simple_png: Failed to open " << filename << "\n";
+    return false;
   }
-
-  debug_log("Loaded PNG %s (%ux%u, pixels=%zu)", filename.c_str(), out.width, out.height, out.pixels.size());
-
-  return true;
+  return decode_png(file.data(), file.size(), out, filename);
 }
 
-void resize_nn(const PNGImage& src, PNGImage& dst, uint32_t w, uint32_t h) {
-  if (src.pixels.size() < src.width * src.height) {
-    std::cerr << "resize_nn: Invalid source pixels size " << src.pixels.size()
-      << ", expected " << src.width * src.height << "\n";
+void resize_nn(const ImageView& src, const ImageView& dst) {
+  const uint32_t w = dst.width;
+  const uint32_t h = dst.height;
+  if (src.width == 0 || src.height == 0) {
     return;
   }
 
   debug_log("Resizing from %ux%u to %ux%u", src.width, src.height, w, h);
 
-  dst.width = w;
-  dst.height = h;
-  dst.pixels.resize(w * h);
+  // Source columns are the same for every row
+  std::vector<uint32_t> src_x(w);
+  for (uint32_t x = 0; x < w; x++) {
+    src_x[x] = static_cast<uint32_t>(static_cast<uint64_t>(x) * src.width / w);
+  }
 
   for (uint32_t y = 0; y < h; y++) {
+    uint32_t sy = static_cast<uint32_t>(static_cast<uint64_t>(y) * src.height / h);
     for (uint32_t x = 0; x < w; x++) {
-      uint32_t sx = x * src.width / w;
-      uint32_t sy = y * src.height / h;
-      size_t sidx = sy * src.width + sx;
-      size_t didx = y * w + x;
-
-      if (sidx >= src.pixels.size()) {
-        std::cerr << "resize_nn: Out-of-bounds sidx=" << sidx << ", src size=" << src.pixels.size() << "\n";
-        return;
-      }
-
-      Pixel px = src.pixels[sidx];
+      uint32_t sx = src_x[x];
+      Pixel px = src.pixel(sx, sy);
 
       // If the sampled pixel is fully transparent, try to find a non-transparent neighbor
       if (px.a == 0) {
@@ -368,9 +605,9 @@ void resize_nn(const PNGImage& src, PNGImage& dst, uint32_t w, uint32_t h) {
             int nx = static_cast<int>(sx) + dx;
             int ny = static_cast<int>(sy) + dy;
             if (nx >= 0 && nx < static_cast<int>(src.width) && ny >= 0 && ny < static_cast<int>(src.height)) {
-              size_t nidx = ny * src.width + nx;
-              if (nidx < src.pixels.size() && src.pixels[nidx].a > 0) { // Check for valid index and non-zero alpha
-                px = src.pixels[nidx];
+              Pixel n = src.pixel(nx, ny);
+              if (n.a > 0) { // Check for non-zero alpha
+                px = n;
                 found = true;
               }
             }
@@ -383,9 +620,9 @@ void resize_nn(const PNGImage& src, PNGImage& dst, uint32_t w, uint32_t h) {
           uint32_t step_y = std::max(1u, src.height / 10);
           for (uint32_t ny_step = 0; ny_step < src.height && !found; ny_step += step_y) {
             for (uint32_t nx_step = 0; nx_step < src.width && !found; nx_step += step_x) {
-              size_t nidx = ny_step * src.width + nx_step;
-              if (nidx < src.pixels.size() && src.pixels[nidx].a > 0) { // Check for valid index and non-zero alpha
-                px = src.pixels[nidx];
+              Pixel n = src.pixel(nx_step, ny_step);
+              if (n.a > 0) { // Check for non-zero alpha
+                px = n;
                 found = true;
               }
             }
@@ -398,14 +635,28 @@ void resize_nn(const PNGImage& src, PNGImage& dst, uint32_t w, uint32_t h) {
         }
       }
 
-      dst.pixels[didx] = px;
+      dst.set_pixel(x, y, px);
     }
   }
 
   // Sample a few resized pixels for debugging
-  for (uint32_t i = 0; i < 3 && i < dst.pixels.size(); ++i) {
-    const Pixel& p = dst.pixels[i];
+  for (uint32_t i = 0; i < 3 && i < w * h; ++i) {
+    Pixel p = dst.pixel(i % w, i / w);
     debug_log("Resized pixel sample (%u,%u): R=%u, G=%u, B=%u, A=%u",
       (i % w), (i / w), (unsigned)p.r, (unsigned)p.g, (unsigned)p.b, (unsigned)p.a);
   }
 }
+
+void resize_nn(const PNGImage& src, PNGImage& dst, uint32_t w, uint32_t h) {
+  if (src.pixels.size() < src.width * src.height) {
+    std::cerr << "resize_nn: Invalid source pixels size " << src.pixels.size()
+      << ", expected " << src.width * src.height << "\n";
+    return;
+  }
+
+  dst.width = w;
+  dst.height = h;
+  dst.pixels.resize(w * h);
+  resize_nn(ImageView::interleaved(src.pixels.data(), src.width, src.height),
+    ImageView::interleaved(dst.pixels.data(), w, h));
+}
@@ -0,0 +1,110 @@
+#include <cstring>
+#include <iostream>
+#include <string>
+#include "png_chunks.h"
+#include "crc.h"
+#include "utils.h"
+
+static bool is_type(const PngChunk& c, const char* type) {
+  return std::memcmp(c.type, type, 4) == 0;
+}
+
+bool parse_png_chunks(const uint8_t* data, size_t size, std::vector<PngChunk>& chunks, bool verify_crc) {
+  chunks.clear();
+  if (size < 8 || std::memcmp(data, "\x89PNG\r\n\x1a\n", 8) != 0) {
+    std::cerr << "parse_png_chunks: Not a PNG stream\n";
+    return false;
+  }
+  size_t pos = 8;
+  while (pos + 12 <= size) {
+    PngChunk c;
+    c.length = read_be_uint32(data + pos);
+    std::memcpy(c.type, data + pos + 4, 4);
+    if (c.length > size - pos - 12) {
+      std::cerr << "parse_png_chunks: Truncated " << std::string(c.type, 4) << " chunk\n";
+      return false;
+    }
+    c.data = data + pos + 8;
+    c.crc = read_be_uint32(c.data + c.length);
+    // The CRC covers the type and the data
+    if (verify_crc && crc(data + pos + 4, c.length + 4) != c.crc) {
+      std::cerr << "parse_png_chunks: CRC mismatch in " << std::string(c.type, 4) << " chunk\n";
+      return false;
+    }
+    chunks.push_back(c);
+    pos += 12 + static_cast<size_t>(c.length);
+    if (is_type(c, "IEND")) {
+      return true;
+    }
+  }
+  std::cerr << "parse_png_chunks: Missing IEND chunk\n";
+  return false;
+}
+
+bool rewrite_png_chunks(const uint8_t* data, size_t size, std::vector<uint8_t>& out) {
+  std::vector<PngChunk> chunks;
+  if (!parse_png_chunks(data, size, chunks, true)) {
+    return false;
+  }
+  if (chunks.empty() || !is_type(chunks[0], "IHDR")) {
+    std::cerr << "rewrite_png_chunks: IHDR is not the first chunk\n";
+    return false;
+  }
+
+  // Bit 5 of the first type byte (lowercase) marks an ancillary chunk; tRNS is
+  // the one ancillary chunk that changes the pixels
+  auto keep = [](const PngChunk& c) {
+    return (c.type[0] & 0x20) == 0 || is_type(c, "tRNS");
+  };
+
+  // Size the output exactly, so the bytes are copied once with no regrowth
+  size_t total = 8;
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    if (!keep(chunks[i])) continue;
+    bool continues_idat = i > 0 && is_type(chunks[i], "IDAT") && is_type(chunks[i - 1], "IDAT");
+    total += chunks[i].length + (continues_idat ? 0 : 12);
+  }
+  out.clear();
+  out.reserve(total);
+  out.insert(out.end(), data, data + 8);
+
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    const PngChunk& c = chunks[i];
+    if (!keep(c)) {
+      debug_log("rewrite_png_chunks: Dropping %.4s (%u bytes)", c.type, c.length);
+      continue;
+    }
+    if (!is_type(c, "IDAT") || i + 1 >= chunks.size() || !is_type(chunks[i + 1], "IDAT")) {
+      // Kept verbatim, CRC included
+      const uint8_t* start = c.data - 8;
+      out.insert(out.end(), start, start + 12 + c.length);
+      continue;
+    }
+
+    // A run of IDATs (which the format requires to be consecutive) becomes one
+    size_t end = i;
+    uint64_t length = 0;
+    while (end < chunks.size() && is_type(chunks[end], "IDAT")) {
+      length += chunks[end].length;
+      end++;
+    }
+    if (length > 0x7fffffff) {
+      std::cerr << "rewrite_png_chunks: Image data too large for one IDAT\n";
+      return false;
+    }
+    uint8_t header[8];
+    write_be_uint32(header, static_cast<uint32_t>(length));
+    std::memcpy(header + 4, "IDAT", 4);
+    out.insert(out.end(), header, header + 8);
+    uint32_t running = update_crc(0xffffffff, header + 4, 4);
+    for (size_t j = i; j < end; ++j) {
+      out.insert(out.end(), chunks[j].data, chunks[j].data + chunks[j].length);
+      running = update_crc(running, chunks[j].data, chunks[j].length);
+    }
+    write_be_uint32(header, running ^ 0xffffffff);
+    out.insert(out.end(), header, header + 4);
+    debug_log("rewrite_png_chunks: Merged %zu IDAT chunks", end - i);
+    i = end - 1;
+  }
+  return true;
+}
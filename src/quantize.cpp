@@ -0,0 +1,319 @@
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+#include "quantize.h"
+#include "arena.h"
+#include "utils.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define QUANTIZE_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+const size_t kMaxColors = 256;
+const int kRefinePasses = 3;
+
+inline uint32_t pack_rgba(const Pixel& p) {
+  return static_cast<uint32_t>(p.r) | (static_cast<uint32_t>(p.g) << 8) |
+    (static_cast<uint32_t>(p.b) << 16) | (static_cast<uint32_t>(p.a) << 24);
+}
+
+inline Pixel unpack_rgba(uint32_t v) {
+  return Pixel{ static_cast<uint8_t>(v), static_cast<uint8_t>(v >> 8), static_cast<uint8_t>(v >> 16), static_cast<uint8_t>(v >> 24) };
+}
+
+inline uint8_t channel(const Pixel& p, int c) {
+  return c == 0 ? p.r : c == 1 ? p.g : c == 2 ? p.b : p.a;
+}
+
+inline uint8_t clamp_channel(int v) {
+  return static_cast<uint8_t>(v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+struct HistEntry {
+  Pixel color;
+  uint32_t count;
+};
+
+// A run of histogram entries that becomes one palette colour
+struct Box {
+  size_t begin, end;
+  int channel;       // Widest channel, the one a split sorts on
+  uint64_t priority; // Widest range times pixel count; 0 when it cannot split
+};
+
+void measure(Box& box, const std::vector<HistEntry>& colors) {
+  uint8_t lo[4] = { 255, 255, 255, 255 }, hi[4] = { 0, 0, 0, 0 };
+  uint64_t pixels = 0;
+  for (size_t i = box.begin; i < box.end; ++i) {
+    for (int c = 0; c < 4; ++c) {
+      lo[c] = std::min(lo[c], channel(colors[i].color, c));
+      hi[c] = std::max(hi[c], channel(colors[i].color, c));
+    }
+    pixels += colors[i].count;
+  }
+  box.channel = 0;
+  for (int c = 1; c < 4; ++c) {
+    if (hi[c] - lo[c] > hi[box.channel] - lo[box.channel]) box.channel = c;
+  }
+  box.priority = box.end - box.begin < 2 ? 0 : static_cast<uint64_t>(hi[box.channel] - lo[box.channel]) * pixels;
+}
+
+// Splits the histogram at the weighted median of the widest box until there
+// are max_colors boxes, then averages each box
+std::vector<Pixel> median_cut(std::vector<HistEntry>& colors, size_t max_colors) {
+  std::vector<Box> boxes{ { 0, colors.size(), 0, 0 } };
+  measure(boxes[0], colors);
+
+  while (boxes.size() < max_colors) {
+    auto widest = std::max_element(boxes.begin(), boxes.end(), [](const Box& a, const Box& b) { return a.priority < b.priority; });
+    if (widest->priority == 0) {
+      break;
+    }
+    Box box = *widest;
+    const int c = box.channel;
+    std::sort(colors.begin() + box.begin, colors.begin() + box.end,
+      [c](const HistEntry& a, const HistEntry& b) { return channel(a.color, c) < channel(b.color, c); });
+
+    uint64_t total = 0;
+    for (size_t i = box.begin; i < box.end; ++i) total += colors[i].count;
+    uint64_t seen = 0;
+    size_t split = box.begin + 1;
+    for (size_t i = box.begin; i < box.end - 1; ++i) {
+      seen += colors[i].count;
+      split = i + 1;
+      if (seen * 2 >= total) break;
+    }
+
+    Box low{ box.begin, split, 0, 0 }, high{ split, box.end, 0, 0 };
+    measure(low, colors);
+    measure(high, colors);
+    *widest = low;
+    boxes.push_back(high);
+  }
+
+  std::vector<Pixel> palette;
+  palette.reserve(boxes.size());
+  for (const Box& box : boxes) {
+    uint64_t sum[4] = { 0, 0, 0, 0 }, pixels = 0;
+    for (size_t i = box.begin; i < box.end; ++i) {
+      for (int c = 0; c < 4; ++c) sum[c] += static_cast<uint64_t>(channel(colors[i].color, c)) * colors[i].count;
+      pixels += colors[i].count;
+    }
+    palette.push_back(Pixel{ static_cast<uint8_t>((sum[0] + pixels / 2) / pixels), static_cast<uint8_t>((sum[1] + pixels / 2) / pixels),
+      static_cast<uint8_t>((sum[2] + pixels / 2) / pixels), static_cast<uint8_t>((sum[3] + pixels / 2) / pixels) });
+  }
+  return palette;
+}
+
+// Nearest palette entry by squared RGBA distance, ties to the lower index.
+// Results are memoised in a direct-mapped cache, since icons repeat colours.
+class NearestColor {
+public:
+  explicit NearestColor(const std::vector<Pixel>& palette) : palette_(palette) {
+    // Entries in groups of four as interleaved (r, g) and (b, a) pairs, padded
+    // with copies of entry 0 that can never win a tie against it
+    const size_t padded = (palette.size() + 3) / 4 * 4;
+    rg_.resize(padded * 2);
+    ba_.resize(padded * 2);
+    for (size_t i = 0; i < padded; ++i) {
+      const Pixel& p = palette[i < palette.size() ? i : 0];
+      rg_[2 * i] = p.r; rg_[2 * i + 1] = p.g;
+      ba_[2 * i] = p.b; ba_[2 * i + 1] = p.a;
+    }
+    std::memset(cache_index_, 0xFF, sizeof(cache_index_));
+  }
+
+  int find(const Pixel& p) {
+    const uint32_t key = pack_rgba(p);
+    const size_t slot = (key * 2654435761u) >> (32 - kCacheBits);
+    if (cache_index_[slot] < 0 || cache_key_[slot] != key) {
+      cache_key_[slot] = key;
+      cache_index_[slot] = static_cast<int16_t>(search(p));
+    }
+    return cache_index_[slot];
+  }
+
+  const Pixel& color(int index) const { return palette_[index]; }
+
+private:
+  static const int kCacheBits = 12;
+
+  int search(const Pixel& p) const {
+    const size_t groups = rg_.size() / 8;
+#ifdef QUANTIZE_USE_SSE2
+    const __m128i prg = _mm_set1_epi32(static_cast<int>(p.r | (p.g << 16)));
+    const __m128i pba = _mm_set1_epi32(static_cast<int>(p.b | (p.a << 16)));
+    __m128i best_d = _mm_set1_epi32(INT32_MAX);
+    __m128i best_i = _mm_setzero_si128();
+    __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i four = _mm_set1_epi32(4);
+    for (size_t g = 0; g < groups; ++g) {
+      __m128i drg = _mm_sub_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rg_.data() + g * 8)), prg);
+      __m128i dba = _mm_sub_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ba_.data() + g * 8)), pba);
+      __m128i d = _mm_add_epi32(_mm_madd_epi16(drg, drg), _mm_madd_epi16(dba, dba));
+      __m128i closer = _mm_cmplt_epi32(d, best_d);
+      best_d = _mm_or_si128(_mm_and_si128(closer, d), _mm_andnot_si128(closer, best_d));
+      best_i = _mm_or_si128(_mm_and_si128(closer, index), _mm_andnot_si128(closer, best_i));
+      index = _mm_add_epi32(index, four);
+    }
+    alignas(16) int32_t d[4], i[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(d), best_d);
+    _mm_store_si128(reinterpret_cast<__m128i*>(i), best_i);
+    int best = 0;
+    for (int lane = 1; lane < 4; ++lane) {
+      if (d[lane] < d[best] || (d[lane] == d[best] && i[lane] < i[best])) best = lane;
+    }
+    return i[best];
+#else
+    int best = 0;
+    int32_t best_d = INT32_MAX;
+    for (size_t e = 0; e < groups * 4; ++e) {
+      int32_t dr = rg_[2 * e] - p.r, dg = rg_[2 * e + 1] - p.g, db = ba_[2 * e] - p.b, da = ba_[2 * e + 1] - p.a;
+      int32_t d = dr * dr + dg * dg + db * db + da * da;
+      if (d < best_d) {
+        best_d = d;
+        best = static_cast<int>(e);
+      }
+    }
+    return best;
+#endif
+  }
+
+  std::vector<Pixel> palette_;
+  std::vector<int16_t> rg_, ba_;
+  uint32_t cache_key_[1 << kCacheBits];
+  int16_t cache_index_[1 << kCacheBits];
+};
+
+// Lloyd (k-means) passes over the histogram, starting from the median cut
+void refine(const std::vector<HistEntry>& colors, std::vector<Pixel>& palette) {
+  for (int pass = 0; pass < kRefinePasses; ++pass) {
+    NearestColor nearest(palette);
+    std::vector<uint64_t> sums(palette.size() * 5, 0);
+    for (const HistEntry& e : colors) {
+      uint64_t* s = &sums[nearest.find(e.color) * 5];
+      for (int c = 0; c < 4; ++c) s[c] += static_cast<uint64_t>(channel(e.color, c)) * e.count;
+      s[4] += e.count;
+    }
+    for (size_t k = 0; k < palette.size(); ++k) {
+      const uint64_t* s = &sums[k * 5];
+      if (s[4] == 0) continue; // Unused entries keep their colour
+      palette[k] = Pixel{ static_cast<uint8_t>((s[0] + s[4] / 2) / s[4]), static_cast<uint8_t>((s[1] + s[4] / 2) / s[4]),
+        static_cast<uint8_t>((s[2] + s[4] / 2) / s[4]), static_cast<uint8_t>((s[3] + s[4] / 2) / s[4]) };
+    }
+  }
+}
+
+// Alpha-weighted PSNR: colour errors count in proportion to the source alpha
+double psnr(const ImageView& a, const ImageView& b) {
+  double sum = 0;
+  for (uint32_t y = 0; y < a.height; ++y) {
+    for (uint32_t x = 0; x < a.width; ++x) {
+      Pixel p = a.pixel(x, y), q = b.pixel(x, y);
+      int dr = p.r - q.r, dg = p.g - q.g, db = p.b - q.b, da = p.a - q.a;
+      sum += (dr * dr + dg * dg + db * db) * (p.a / 255.0) + da * da;
+    }
+  }
+  double mse = sum / (4.0 * a.width * a.height);
+  return mse == 0 ? INFINITY : 10.0 * std::log10(255.0 * 255.0 / mse);
+}
+
+} // namespace
+
+bool quantize_image(const ImageView& src, const ImageView& dst, const QuantizeOptions& options) {
+  const uint32_t width = src.width;
+  const uint32_t height = src.height;
+
+  // Exact colours first; at most 256 is left to the lossless palette path
+  std::unordered_map<uint32_t, uint32_t> exact;
+  exact.reserve(static_cast<size_t>(width) * height);
+  for (uint32_t y = 0; y < height; ++y) {
+    for (uint32_t x = 0; x < width; ++x) {
+      ++exact[pack_rgba(src.pixel(x, y))];
+    }
+  }
+  if (exact.size() <= kMaxColors) {
+    return false;
+  }
+
+  // Fully transparent pixels share one reserved entry and stay out of the cut
+  std::vector<HistEntry> colors;
+  colors.reserve(exact.size());
+  bool transparent = false;
+  for (const auto& e : exact) {
+    Pixel p = unpack_rgba(e.first);
+    if (p.a == 0) {
+      transparent = true;
+      continue;
+    }
+    colors.push_back({ p, e.second });
+  }
+  if (colors.empty()) {
+    return false; // Nothing visible to quantize
+  }
+  // Iteration order of the map is unspecified; sort so the palette is reproducible
+  std::sort(colors.begin(), colors.end(), [](const HistEntry& a, const HistEntry& b) { return pack_rgba(a.color) < pack_rgba(b.color); });
+
+  std::vector<Pixel> palette = median_cut(colors, kMaxColors - (transparent ? 1 : 0));
+  refine(colors, palette);
+  // Visible pixels never map to the transparent entry, so it is not searched
+  NearestColor nearest(palette);
+  const Pixel clear{ 0, 0, 0, 0 };
+
+  ScratchLease scratch;
+  // Floyd-Steinberg error rows in sixteenths, one pixel of padding on each side
+  const size_t err_len = (static_cast<size_t>(width) + 2) * 4;
+  int32_t* err_cur = scratch->allocate_array<int32_t>(err_len);
+  int32_t* err_next = scratch->allocate_array<int32_t>(err_len);
+  if (!err_cur || !err_next) {
+    return false;
+  }
+  std::memset(err_cur, 0, err_len * sizeof(int32_t));
+
+  for (uint32_t y = 0; y < height; ++y) {
+    std::memset(err_next, 0, err_len * sizeof(int32_t));
+    // Serpentine order keeps the diffusion from drifting in one direction
+    const bool reverse = options.dither && (y & 1);
+    for (uint32_t i = 0; i < width; ++i) {
+      const uint32_t x = reverse ? width - 1 - i : i;
+      Pixel p = src.pixel(x, y);
+      if (p.a == 0) {
+        dst.set_pixel(x, y, clear);
+        continue;
+      }
+
+      Pixel want = p;
+      int32_t* e = err_cur + (x + 1) * 4;
+      if (options.dither) {
+        want = Pixel{ clamp_channel(p.r + e[0] / 16), clamp_channel(p.g + e[1] / 16),
+          clamp_channel(p.b + e[2] / 16), clamp_channel(p.a + e[3] / 16) };
+      }
+      const Pixel& got = nearest.color(nearest.find(want));
+      dst.set_pixel(x, y, got);
+
+      if (options.dither) {
+        const int dir = reverse ? -1 : 1;
+        int32_t* ahead = e + dir * 4;
+        int32_t* below = err_next + (x + 1) * 4;
+        for (int c = 0; c < 4; ++c) {
+          int32_t diff = channel(want, c) - channel(got, c);
+          ahead[c] += diff * 7;
+          below[c - dir * 4] += diff * 3;
+          below[c] += diff * 5;
+          below[c + dir * 4] += diff;
+        }
+      }
+    }
+    std::swap(err_cur, err_next);
+  }
+
+  double quality = psnr(src, dst);
+  debug_log("quantize_image: %ux%u, %zu colours to %zu, PSNR %.2f dB", width, height, exact.size(), palette.size() + (transparent ? 1 : 0), quality);
+  return quality >= options.min_psnr;
+}
@@ -0,0 +1,247 @@
+#include <cstring>
+#include <iostream>
+#include "rle.h"
+#include "arena.h"
+#include "utils.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RLE_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static inline unsigned count_trailing_zeros(uint32_t v) {
+#ifdef _MSC_VER
+  unsigned long idx;
+  _BitScanForward(&idx, v);
+  return static_cast<unsigned>(idx);
+#else
+  return static_cast<unsigned>(__builtin_ctz(v));
+#endif
+}
+
+static const size_t kMinRun = 3;
+static const size_t kMaxRun = 130;
+static const size_t kMaxLiteral = 128;
+
+// Returns the first index >= pos where three equal bytes start, or len if none.
+static size_t find_run_start(const uint8_t* src, size_t pos, size_t len) {
+#ifdef RLE_USE_SSE2
+  // Compare each byte with its two successors, 16 positions at a time
+  while (pos + 18 <= len) {
+    __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + pos));
+    __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + pos + 1));
+    __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + pos + 2));
+    __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(v0, v1), _mm_cmpeq_epi8(v1, v2));
+    uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(eq));
+    if (mask) {
+      return pos + count_trailing_zeros(mask);
+    }
+    pos += 16;
+  }
+#endif
+  for (; pos + kMinRun <= len; ++pos) {
+    if (src[pos] == src[pos + 1] && src[pos] == src[pos + 2]) {
+      return pos;
+    }
+  }
+  return len;
+}
+
+// Returns the length of the run of src[pos] starting at pos, capped at max_len.
+static size_t run_length(const uint8_t* src, size_t pos, size_t len, size_t max_len) {
+  size_t end = (len - pos > max_len) ? pos + max_len : len;
+  size_t i = pos + 1;
+#ifdef RLE_USE_SSE2
+  __m128i value = _mm_set1_epi8(static_cast<char>(src[pos]));
+  while (i + 16 <= end) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, value))) ^ 0xFFFFu;
+    if (mask) {
+      return i + count_trailing_zeros(mask) - pos;
+    }
+    i += 16;
+  }
+#endif
+  while (i < end && src[i] == src[pos]) {
+    ++i;
+  }
+  return i - pos;
+}
+
+static void emit_literals(const uint8_t* src, size_t len, std::vector<uint8_t>& out) {
+  while (len > 0) {
+    size_t n = len > kMaxLiteral ? kMaxLiteral : len;
+    out.push_back(static_cast<uint8_t>(n - 1));
+    out.insert(out.end(), src, src + n);
+    src += n;
+    len -= n;
+  }
+}
+
+void packbits_encode(const uint8_t* src, size_t len, std::vector<uint8_t>& out) {
+  size_t pos = 0;
+  while (pos < len) {
+    size_t run = find_run_start(src, pos, len);
+    emit_literals(src + pos, run - pos, out);
+    if (run >= len) {
+      break;
+    }
+
+    size_t n = run_length(src, run, len, kMaxRun);
+    out.push_back(static_cast<uint8_t>(0x80 + (n - kMinRun)));
+    out.push_back(src[run]);
+    pos = run + n;
+  }
+}
+
+size_t packbits_decode(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_len) {
+  size_t in = 0;
+  size_t out = 0;
+  while (out < dst_len) {
+    if (in >= len) {
+      return 0;
+    }
+    uint8_t header = src[in++];
+    if (header < 0x80) {
+      size_t n = static_cast<size_t>(header) + 1;
+      if (n > len - in || n > dst_len - out) {
+        return 0;
+      }
+      std::memcpy(dst + out, src + in, n);
+      in += n;
+      out += n;
+    }
+    else {
+      size_t n = static_cast<size_t>(header) - 125;
+      if (in >= len || n > dst_len - out) {
+        return 0;
+      }
+      std::memset(dst + out, src[in++], n);
+      out += n;
+    }
+  }
+  return in;
+}
+
+// Packs one channel plane; rows are gathered only when the stride adds padding
+static void packbits_plane(const ImageView& planar, int plane, uint8_t* scratch, std::vector<uint8_t>& out) {
+  const size_t count = static_cast<size_t>(planar.width) * planar.height;
+  if (planar.stride == planar.width) {
+    packbits_encode(planar.planes[plane], count, out);
+    return;
+  }
+  for (uint32_t y = 0; y < planar.height; ++y) {
+    std::memcpy(scratch + static_cast<size_t>(y) * planar.width, planar.row(y, plane), planar.width);
+  }
+  packbits_encode(scratch, count, out);
+}
+
+bool encode_icns_rle(const ImageView& img, std::vector<uint8_t>& out, bool with_it32_header) {
+  // Channels are compressed independently, so work on planar data
+  ScratchLease scratch;
+  ImageView planar = img;
+  if (img.layout != PixelLayout::Planar) {
+    planar = scratch->allocate_image(img.width, img.height, PixelLayout::Planar);
+    if (!planar.planes[0]) {
+      return false;
+    }
+    convert_layout(img, planar);
+  }
+
+  const size_t count = static_cast<size_t>(img.width) * img.height;
+  // Only needed to gather rows when the planes are padded
+  uint8_t* gathered = planar.stride != planar.width ? scratch->allocate_array<uint8_t>(count) : nullptr;
+  if (planar.stride != planar.width && !gathered) {
+    return false;
+  }
+  out.clear();
+  out.reserve(count * 3 + count * 3 / kMaxLiteral + 8);
+  if (with_it32_header) {
+    out.insert(out.end(), 4, 0);
+  }
+  for (int c = 0; c < 3; ++c) {
+    packbits_plane(planar, c, gathered, out);
+  }
+
+  debug_log("RLE encoded %ux%u: %zu bytes", img.width, img.height, out.size());
+  return true;
+}
+
+bool encode_icns_rle(const PNGImage& img, std::vector<uint8_t>& out, bool with_it32_header) {
+  if (img.pixels.size() < static_cast<size_t>(img.width) * img.height) {
+    std::cerr << "encode_icns_rle: Invalid pixel buffer for " << img.width << "x" << img.height << "\n";
+    return false;
+  }
+  return encode_icns_rle(ImageView::interleaved(img.pixels.data(), img.width, img.height), out, with_it32_header);
+}
+
+bool decode_icns_rle(const uint8_t* data, size_t len, uint32_t size, const uint8_t* mask, bool with_it32_header, PNGImage& out) {
+  const size_t count = static_cast<size_t>(size) * size;
+  if (with_it32_header) {
+    if (len < 4) {
+      std::cerr << "decode_icns_rle: Truncated it32 header\n";
+      return false;
+    }
+    data += 4;
+    len -= 4;
+  }
+
+  // Uncompressed 24-bit data is legal for small elements when the payload is exactly w*h*3
+  ScratchLease scratch;
+  const uint8_t* planes = data;
+  bool raw = !with_it32_header && len == count * 3;
+  if (!raw) {
+    uint8_t* decoded = scratch->allocate_array<uint8_t>(count * 3);
+    if (!decoded) {
+      return false;
+    }
+    planes = decoded;
+    for (int c = 0; c < 3; ++c) {
+      size_t used = packbits_decode(data, len, decoded + c * count, count);
+      if (used == 0) {
+        std::cerr << "decode_icns_rle: Malformed RLE data in channel " << c << "\n";
+        return false;
+      }
+      data += used;
+      len -= used;
+    }
+  }
+
+  out.width = size;
+  out.height = size;
+  out.pixels.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    out.pixels[i] = Pixel{ planes[i], planes[count + i], planes[2 * count + i], mask ? mask[i] : (uint8_t)255 };
+  }
+  return true;
+}
+
+bool encode_icns_mask(const ImageView& img, std::vector<uint8_t>& out) {
+  out.resize(static_cast<size_t>(img.width) * img.height);
+  uint8_t* dst = out.data();
+  for (uint32_t y = 0; y < img.height; ++y) {
+    if (img.layout == PixelLayout::Planar) {
+      std::memcpy(dst, img.row(y, 3), img.width);
+    }
+    else {
+      const uint8_t* row = img.row(y);
+      for (uint32_t x = 0; x < img.width; ++x) {
+        dst[x] = row[x * 4 + 3];
+      }
+    }
+    dst += img.width;
+  }
+  return true;
+}
+
+bool encode_icns_mask(const PNGImage& img, std::vector<uint8_t>& out) {
+  if (img.pixels.size() < static_cast<size_t>(img.width) * img.height) {
+    std::cerr << "encode_icns_mask: Invalid pixel buffer for " << img.width << "x" << img.height << "\n";
+    return false;
+  }
+  return encode_icns_mask(ImageView::interleaved(img.pixels.data(), img.width, img.height), out);
+}
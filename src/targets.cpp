@@ -0,0 +1,362 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include "targets.h"
+#include "output.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+PNGPayload PayloadSet::get(const ImageView& img) {
+  std::promise<PNGPayload> promise;
+  std::shared_future<PNGPayload> result;
+  bool owner = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = payloads_.find(Key{ img.width, img.height });
+    if (it == payloads_.end()) {
+      result = promise.get_future().share();
+      payloads_.emplace(Key{ img.width, img.height }, result);
+      owner = true;
+    }
+    else {
+      result = it->second;
+    }
+  }
+  // Encode outside the lock so different sizes proceed in parallel
+  if (owner) {
+    promise.set_value(encode_icon_png(img, options_));
+  }
+  return result.get();
+}
+
+void PayloadSet::prefetch(const std::vector<ImageView>& images) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const ImageView& img : images) {
+    pending_.push_back(std::async(std::launch::async, [this, img] { get(img); }));
+  }
+}
+
+// Names iconutil expects inside an .iconset, with the pixel size of each
+struct IconsetEntry {
+  uint32_t size;
+  const char* name;
+};
+
+static const IconsetEntry iconset_entries[] = {
+  { 16, "icon_16x16.png" },
+  { 32, "icon_16x16@2x.png" },
+  { 32, "icon_32x32.png" },
+  { 64, "icon_32x32@2x.png" },
+  { 128, "icon_128x128.png" },
+  { 256, "icon_128x128@2x.png" },
+  { 256, "icon_256x256.png" },
+  { 512, "icon_256x256@2x.png" },
+  { 512, "icon_512x512.png" },
+  { 1024, "icon_512x512@2x.png" },
+};
+
+// The sizes Windows picks from for shell views, title bars and the taskbar
+static const uint32_t ico_sizes[] = { 16, 24, 32, 48, 64, 128, 256 };
+// Pointer sizes for 100% to 200% display scaling and the accessibility sizes
+static const uint32_t cur_sizes[] = { 32, 48, 64, 96, 128 };
+// Sizes from which ICO/CUR entries are PNG streams instead of DIBs
+static const uint32_t kIcoPngSize = 256;
+
+OutputTarget output_target(const std::string& path) {
+  std::string ext = fs::u8path(path).extension().u8string();
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  OutputTarget target;
+  target.path = path;
+  if (ext == ".ico") {
+    target.container = IconContainer::Ico;
+  }
+  else if (ext == ".cur") {
+    target.container = IconContainer::Cur;
+  }
+  else if (ext == ".iconset") {
+    target.container = IconContainer::Iconset;
+  }
+  return target;
+}
+
+const char* container_name(IconContainer container) {
+  switch (container) {
+  case IconContainer::Iconset: return "Iconset";
+  case IconContainer::Ico: return "ICO file";
+  case IconContainer::Cur: return "Cursor file";
+  default: return "ICNS file";
+  }
+}
+
+static bool size_requested(const IcnsOptions& options, uint32_t size) {
+  return options.sizes.empty() || std::find(options.sizes.begin(), options.sizes.end(), size) != options.sizes.end();
+}
+
+std::vector<uint32_t> target_sizes(IconContainer container, const IcnsOptions& options) {
+  std::vector<uint32_t> sizes;
+  switch (container) {
+  case IconContainer::Icns:
+    return icns_sizes(options);
+  case IconContainer::Iconset:
+    for (const IconsetEntry& e : iconset_entries) {
+      if (std::find(sizes.begin(), sizes.end(), e.size) == sizes.end()) sizes.push_back(e.size);
+    }
+    break;
+  case IconContainer::Ico:
+    sizes.assign(std::begin(ico_sizes), std::end(ico_sizes));
+    break;
+  case IconContainer::Cur:
+    sizes.assign(std::begin(cur_sizes), std::end(cur_sizes));
+    break;
+  }
+  sizes.erase(std::remove_if(sizes.begin(), sizes.end(), [&](uint32_t sz) { return !size_requested(options, sz); }), sizes.end());
+  return sizes;
+}
+
+bool target_needs_pixels(IconContainer container, uint32_t size, const IcnsOptions& options) {
+  switch (container) {
+  case IconContainer::Icns:
+    return icns_needs_pixels(size, options);
+  case IconContainer::Ico:
+  case IconContainer::Cur: {
+    // Everything below kIcoPngSize is stored as a DIB
+    std::vector<uint32_t> sizes = target_sizes(container, options);
+    return size < kIcoPngSize && std::find(sizes.begin(), sizes.end(), size) != sizes.end();
+  }
+  default:
+    return false;
+  }
+}
+
+static const ImageView* find_image(const std::vector<ImageView>& images, uint32_t size) {
+  for (const ImageView& img : images) {
+    if (img.width == size && img.height == size) return &img;
+  }
+  return nullptr;
+}
+
+// Collects the images for sizes, reporting the first one that is missing
+static bool gather_images(const char* who, const std::vector<ImageView>& images, const std::vector<uint32_t>& sizes,
+  std::vector<ImageView>& out) {
+  if (sizes.empty()) {
+    std::cerr << who << ": None of the selected sizes exist in this format\n";
+    return false;
+  }
+  for (uint32_t size : sizes) {
+    const ImageView* img = find_image(images, size);
+    if (!img) {
+      std::cerr << who << ": Missing icon size " << size << "x" << size << "\n";
+      return false;
+    }
+    out.push_back(*img);
+  }
+  return true;
+}
+
+bool write_iconset(const std::string& directory, const std::vector<ImageView>& images, const IcnsOptions& options) {
+  std::vector<ImageView> needed;
+  if (!gather_images("write_iconset", images, target_sizes(IconContainer::Iconset, options), needed)) {
+    return false;
+  }
+  std::error_code ec;
+  fs::create_directories(fs::u8path(directory), ec);
+  if (!fs::is_directory(fs::u8path(directory), ec)) {
+    std::cerr << "write_iconset: Cannot create directory " << directory << "\n";
+    return false;
+  }
+
+  // Use the caller's payloads when it has them, a private set otherwise
+  PayloadSet local(options);
+  PayloadSet& payloads = options.payloads ? *options.payloads : local;
+  payloads.prefetch(needed);
+
+  for (const IconsetEntry& e : iconset_entries) {
+    if (!size_requested(options, e.size)) {
+      continue;
+    }
+    PNGPayload payload = payloads.get(*find_image(needed, e.size));
+    if (!payload) {
+      std::cerr << "write_iconset: Failed to encode size " << e.size << "\n";
+      return false;
+    }
+    OutputFile out;
+    const std::string path = (fs::u8path(directory) / e.name).u8string();
+    if (!out.open(path, options.output) || !out.write(payload->data(), payload->size()) || !out.close()) {
+      return false;
+    }
+  }
+  debug_log("Successfully wrote iconset: %s", directory.c_str());
+  return true;
+}
+
+static void write_le16(uint8_t* p, uint16_t v) {
+  p[0] = static_cast<uint8_t>(v);
+  p[1] = static_cast<uint8_t>(v >> 8);
+}
+
+static void write_le32(uint8_t* p, uint32_t v) {
+  write_le16(p, static_cast<uint16_t>(v));
+  write_le16(p + 2, static_cast<uint16_t>(v >> 16));
+}
+
+
+// A DIB as stored in ICO/CUR: BITMAPINFOHEADER with twice the height (XOR
+// image plus AND mask), bottom-up BGRA rows, then the mask with a set bit for
+// every fully transparent pixel. Alpha-aware Windows uses the BGRA alpha; the
+// mask keeps transparency on viewers that only know 1-bit masks.
+static void encode_ico_dib(const ImageView& img, std::vector<uint8_t>& out) {
+  const uint32_t w = img.width;
+  const uint32_t h = img.height;
+  const size_t mask_stride = (w + 31) / 32 * 4;
+  out.assign(40 + static_cast<size_t>(w) * h * 4 + mask_stride * h, 0);
+
+  uint8_t* header = out.data();
+  write_le32(header, 40);        // biSize
+  write_le32(header + 4, w);     // biWidth
+  write_le32(header + 8, h * 2); // biHeight
+  write_le16(header + 12, 1);    // biPlanes
+  write_le16(header + 14, 32);   // biBitCount
+  write_le32(header + 20, static_cast<uint32_t>(out.size() - 40)); // biSizeImage
+
+  uint8_t* color = out.data() + 40;
+  uint8_t* mask = color + static_cast<size_t>(w) * h * 4;
+  for (uint32_t y = 0; y < h; ++y) {
+    const uint32_t row = h - 1 - y; // Bottom-up
+    uint8_t* c = color + static_cast<size_t>(row) * w * 4;
+    uint8_t* m = mask + row * mask_stride;
+    for (uint32_t x = 0; x < w; ++x) {
+      Pixel p = img.pixel(x, y);
+      c[x * 4 + 0] = p.b;
+      c[x * 4 + 1] = p.g;
+      c[x * 4 + 2] = p.r;
+      c[x * 4 + 3] = p.a;
+      if (p.a == 0) {
+        m[x >> 3] |= static_cast<uint8_t>(0x80 >> (x & 7));
+      }
+    }
+  }
+}
+
+static bool write_ico_file(const char* who, IconContainer container, const std::string& filename,
+  const std::vector<ImageView>& images, const IcnsOptions& options) {
+  std::vector<ImageView> needed;
+  if (!gather_images(who, images, target_sizes(container, options), needed)) {
+    return false;
+  }
+  const bool cursor = container == IconContainer::Cur;
+
+  // Only the PNG entries go through the (shared) encoder
+  PayloadSet local(options);
+  PayloadSet& payloads = options.payloads ? *options.payloads : local;
+  std::vector<ImageView> png_sizes;
+  for (const ImageView& img : needed) {
+    if (img.width >= kIcoPngSize) png_sizes.push_back(img);
+  }
+  payloads.prefetch(png_sizes);
+
+  // The directory needs every length, so entries are built before anything is written
+  std::vector<PNGPayload> entries;
+  for (const ImageView& img : needed) {
+    if (img.width >= kIcoPngSize) {
+      entries.push_back(payloads.get(img));
+    }
+    else {
+      auto dib = std::make_shared<std::vector<uint8_t>>();
+      encode_ico_dib(img, *dib);
+      entries.push_back(std::move(dib));
+    }
+    if (!entries.back()) {
+      std::cerr << who << ": Failed to encode size " << img.width << "\n";
+      return false;
+    }
+  }
+
+  // ICONDIR followed by one 16-byte ICONDIRENTRY per image
+  std::vector<uint8_t> directory(6 + 16 * entries.size());
+  write_le16(&directory[0], 0);
+  write_le16(&directory[2], cursor ? 2 : 1);
+  write_le16(&directory[4], static_cast<uint16_t>(entries.size()));
+  uint64_t offset = directory.size();
+  for (size_t i = 0; i < entries.size(); ++i) {
+    uint8_t* e = &directory[6 + 16 * i];
+    const uint32_t size = needed[i].width;
+    e[0] = static_cast<uint8_t>(size >= 256 ? 0 : size); // 0 means 256
+    e[1] = static_cast<uint8_t>(size >= 256 ? 0 : size);
+    e[2] = 0; // No palette
+    e[3] = 0;
+    if (cursor) {
+      // Cursors reuse the planes and bit count fields for the hotspot
+      const float max = static_cast<float>(size - 1);
+      write_le16(e + 4, static_cast<uint16_t>(std::min(max, options.hotspot_x * size)));
+      write_le16(e + 6, static_cast<uint16_t>(std::min(max, options.hotspot_y * size)));
+    }
+    else {
+      write_le16(e + 4, 1);  // Colour planes
+      write_le16(e + 6, 32); // Bits per pixel
+    }
+    write_le32(e + 8, static_cast<uint32_t>(entries[i]->size()));
+    write_le32(e + 12, static_cast<uint32_t>(offset));
+    offset += entries[i]->size();
+  }
+  if (offset > UINT32_MAX) {
+    std::cerr << who << ": " << filename << " would exceed the 4 GB limit\n";
+    return false;
+  }
+
+  std::vector<IoSegment> segments;
+  segments.push_back({ directory.data(), directory.size() });
+  for (const PNGPayload& p : entries) {
+    segments.push_back({ p->data(), p->size() });
+  }
+  OutputFile out;
+  if (!out.open(filename, options.output) || !out.write(segments.data(), segments.size())) {
+    return false;
+  }
+  if (!out.close()) {
+    return false;
+  }
+  debug_log("%s: Successfully wrote %s", who, filename.c_str());
+  return true;
+}
+
+bool write_ico(const std::string& filename, const std::vector<ImageView>& images, const IcnsOptions& options) {
+  return write_ico_file("write_ico", IconContainer::Ico, filename, images, options);
+}
+
+bool write_cur(const std::string& filename, const std::vector<ImageView>& images, const IcnsOptions& options) {
+  return write_ico_file("write_cur", IconContainer::Cur, filename, images, options);
+}
+
+bool write_targets(const std::vector<OutputTarget>& targets, const std::vector<ImageView>& images, const IcnsOptions& options) {
+  // With several containers every PNG payload is encoded once and shared
+  PayloadSet payloads(options);
+  IcnsOptions shared = options;
+  if (targets.size() > 1) {
+    shared.payloads = &payloads;
+  }
+
+  for (const OutputTarget& t : targets) {
+    bool ok = false;
+    switch (t.container) {
+    case IconContainer::Icns:
+      ok = write_icns(t.path.c_str(), images, shared);
+      break;
+    case IconContainer::Iconset:
+      ok = write_iconset(t.path, images, shared);
+      break;
+    case IconContainer::Ico:
+      ok = write_ico(t.path, images, shared);
+      break;
+    case IconContainer::Cur:
+      ok = write_cur(t.path, images, shared);
+      break;
+    }
+    if (!ok) {
+      std::cerr << "Failed to write " << container_name(t.container) << ": " << t.path << "\n";
+      return false;
+    }
+  }
+  return true;
+}
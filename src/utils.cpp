@@ -1,7 +1,15 @@
 #include <cstdarg>
 #include <cstdio>
+#include <cstring>
 #include "utils.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <stdlib.h>
+#endif
+
 void write_be_uint32(uint8_t* buf, uint32_t val) {
   buf[0] = (val >> 24) & 0xFF;
   buf[1] = (val >> 16) & 0xFF;
@@ -9,6 +17,77 @@ void write_be_uint32(uint8_t* buf, uint32_t val) {
   buf[3] = val & 0xFF;
 }
 
+uint32_t read_be_uint32(const uint8_t* buf) {
+  return (static_cast<uint32_t>(buf[0]) << 24) | (static_cast<uint32_t>(buf[1]) << 16) |
+    (static_cast<uint32_t>(buf[2]) << 8) | buf[3];
+}
+
+static inline uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  const uint64_t k = 0x9e3779b97f4a7c15ULL;
+  uint64_t h = seed ^ (len * k);
+
+  // Process 8 bytes at a time; pixel buffers are always a multiple of 4
+  while (len >= 8) {
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    h = (h ^ mix64(v)) * k;
+    p += 8;
+    len -= 8;
+  }
+
+  uint64_t tail = 0;
+  std::memcpy(&tail, p, len);
+  h = (h ^ mix64(tail ^ len)) * k;
+
+  return mix64(h);
+}
+
+void* aligned_malloc(size_t size, size_t alignment) {
+#ifdef _WIN32
+  return _aligned_malloc(size, alignment);
+#else
+  void* p = nullptr;
+  if (posix_memalign(&p, alignment < sizeof(void*) ? sizeof(void*) : alignment, size) != 0) {
+    return nullptr;
+  }
+  return p;
+#endif
+}
+
+void aligned_free(void* ptr) {
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+#ifdef _WIN32
+std::wstring utf8_to_wide(const std::string& str) {
+  int len = MultiByteToWideChar(CP_UTF8, 0, str.c_str(), -1, nullptr, 0);
+  std::wstring wstr(len > 0 ? len - 1 : 0, L'\0');
+  if (len > 1) MultiByteToWideChar(CP_UTF8, 0, str.c_str(), -1, &wstr[0], len);
+  return wstr;
+}
+
+std::string wide_to_utf8(const std::wstring& wstr) {
+  int len = WideCharToMultiByte(CP_UTF8, 0, wstr.data(), static_cast<int>(wstr.size()), nullptr, 0, nullptr, nullptr);
+  std::string str(len > 0 ? len : 0, '\0');
+  if (len > 0) WideCharToMultiByte(CP_UTF8, 0, wstr.data(), static_cast<int>(wstr.size()), &str[0], len, nullptr, nullptr);
+  return str;
+}
+#endif
+
 #ifdef _DEBUG
 void debug_log(const char* format, ...) {
   va_list args;
@@ -0,0 +1,337 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <cerrno>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "watch.h"
+#include "cache.h"
+#include "utils.h"
+
+namespace fs = std::filesystem;
+
+#if defined(_WIN32)
+
+DirectoryWatcher::~DirectoryWatcher() {
+  if (handle_ && handle_ != INVALID_HANDLE_VALUE) {
+    CancelIo(handle_);
+    CloseHandle(handle_);
+  }
+  if (event_) CloseHandle(event_);
+  delete static_cast<OVERLAPPED*>(overlapped_);
+}
+
+bool DirectoryWatcher::open(const std::string& directory) {
+  directory_ = directory;
+  handle_ = CreateFileW(utf8_to_wide(directory).c_str(), FILE_LIST_DIRECTORY,
+    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+    FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+  if (handle_ == INVALID_HANDLE_VALUE) {
+    std::fprintf(stderr, "Error: Cannot watch directory %s\n", directory.c_str());
+    return false;
+  }
+  event_ = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+  OVERLAPPED* ov = new OVERLAPPED();
+  ov->hEvent = event_;
+  overlapped_ = ov;
+  buffer_.resize(16384); // DWORD-aligned, as ReadDirectoryChangesW requires
+  return issue();
+}
+
+bool DirectoryWatcher::issue() {
+  ResetEvent(event_);
+  if (!ReadDirectoryChangesW(handle_, buffer_.data(), static_cast<DWORD>(buffer_.size() * sizeof(uint32_t)), FALSE,
+    FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE,
+    nullptr, static_cast<OVERLAPPED*>(overlapped_), nullptr)) {
+    std::fprintf(stderr, "Error: ReadDirectoryChangesW failed for %s\n", directory_.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool DirectoryWatcher::wait(int timeout_ms, std::vector<std::string>& changed) {
+  DWORD r = WaitForSingleObject(event_, timeout_ms < 0 ? INFINITE : static_cast<DWORD>(timeout_ms));
+  if (r == WAIT_TIMEOUT) {
+    return true;
+  }
+  DWORD bytes = 0;
+  if (r != WAIT_OBJECT_0 || !GetOverlappedResult(handle_, static_cast<OVERLAPPED*>(overlapped_), &bytes, FALSE)) {
+    return false;
+  }
+  if (bytes == 0) {
+    changed.emplace_back(); // Buffer overflow: the events themselves are lost
+  }
+  else {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(buffer_.data());
+    while (true) {
+      const FILE_NOTIFY_INFORMATION* info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(p);
+      changed.push_back(wide_to_utf8(std::wstring(info->FileName, info->FileNameLength / sizeof(WCHAR))));
+      if (info->NextEntryOffset == 0) break;
+      p += info->NextEntryOffset;
+    }
+  }
+  return issue();
+}
+
+#elif defined(__linux__)
+
+DirectoryWatcher::~DirectoryWatcher() {
+  if (fd_ >= 0) ::close(fd_);
+}
+
+bool DirectoryWatcher::open(const std::string& directory) {
+  directory_ = directory;
+  fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd_ < 0 || inotify_add_watch(fd_, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MODIFY | IN_DELETE) < 0) {
+    std::fprintf(stderr, "Error: Cannot watch directory %s (%s)\n", directory.c_str(), std::strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool DirectoryWatcher::wait(int timeout_ms, std::vector<std::string>& changed) {
+  pollfd p{ fd_, POLLIN, 0 };
+  int r = poll(&p, 1, timeout_ms);
+  if (r <= 0) {
+    return r == 0 || errno == EINTR;
+  }
+
+  alignas(inotify_event) char buf[16384];
+  ssize_t n;
+  while ((n = read(fd_, buf, sizeof(buf))) > 0) {
+    for (char* e = buf; e < buf + n; ) {
+      const inotify_event* ev = reinterpret_cast<const inotify_event*>(e);
+      if (ev->mask & IN_Q_OVERFLOW) {
+        changed.emplace_back();
+      }
+      else if (ev->len > 0) {
+        changed.emplace_back(ev->name);
+      }
+      e += sizeof(inotify_event) + ev->len;
+    }
+  }
+  return true;
+}
+
+#else
+
+// No native notifications here: compare modification times every half second
+DirectoryWatcher::~DirectoryWatcher() = default;
+
+void DirectoryWatcher::scan(std::vector<std::pair<std::string, int64_t>>& out) const {
+  out.clear();
+  std::error_code ec;
+  for (const auto& entry : fs::directory_iterator(fs::u8path(directory_), ec)) {
+    std::error_code ignored;
+    auto stamp = entry.last_write_time(ignored).time_since_epoch().count();
+    out.emplace_back(entry.path().filename().u8string(), static_cast<int64_t>(stamp) ^ static_cast<int64_t>(entry.file_size(ignored)));
+  }
+  std::sort(out.begin(), out.end());
+}
+
+bool DirectoryWatcher::open(const std::string& directory) {
+  directory_ = directory;
+  std::error_code ec;
+  if (!fs::is_directory(fs::u8path(directory), ec)) {
+    std::fprintf(stderr, "Error: Cannot watch directory %s\n", directory.c_str());
+    return false;
+  }
+  scan(snapshot_);
+  return true;
+}
+
+bool DirectoryWatcher::wait(int timeout_ms, std::vector<std::string>& changed) {
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::pair<std::string, int64_t>> now;
+  while (true) {
+    scan(now);
+    // Anything added, removed or touched since the last scan
+    std::vector<std::pair<std::string, int64_t>> diff;
+    std::set_symmetric_difference(now.begin(), now.end(), snapshot_.begin(), snapshot_.end(), std::back_inserter(diff));
+    snapshot_.swap(now);
+    for (const auto& d : diff) {
+      if (std::find(changed.begin(), changed.end(), d.first) == changed.end()) changed.push_back(d.first);
+    }
+    if (!diff.empty()) {
+      return true;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    if (timeout_ms >= 0 && elapsed >= timeout_ms) {
+      return true;
+    }
+    int64_t step = timeout_ms < 0 ? 500 : std::min<int64_t>(500, timeout_ms - elapsed);
+    std::this_thread::sleep_for(std::chrono::milliseconds(step));
+  }
+}
+
+#endif
+
+static bool is_image_name(const std::string& name) {
+  std::string ext = fs::u8path(name).extension().u8string();
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext == ".png" || ext == ".jpg" || ext == ".jpeg";
+}
+
+// Copies the whole file into out; an empty file counts as not there yet.
+// Watched files are not mapped: an editor truncating one mid-conversion would
+// fault the mapping (SIGBUS), and on Windows an open mapping makes the
+// editor's own save fail.
+static bool read_file(const fs::path& path, std::vector<uint8_t>& out) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  out.clear();
+  char buf[65536];
+  while (in.read(buf, sizeof(buf)) || in.gcount() > 0) {
+    out.insert(out.end(), buf, buf + in.gcount());
+  }
+  return in.eof() && !out.empty();
+}
+
+namespace {
+
+// Last successfully converted content of one source
+struct SourceState {
+  uint64_t hash = 0;
+  bool converted = false;
+};
+
+} // namespace
+
+int run_watch(const ConvertJob& base, PayloadCache* cache) {
+  std::error_code ec;
+  const fs::path input = fs::u8path(base.input);
+  const bool directory_mode = fs::is_directory(input, ec);
+  fs::path directory = directory_mode ? input : input.parent_path();
+  if (directory.empty()) {
+    directory = ".";
+  }
+  const std::string file_name = input.filename().u8string();
+
+  if (directory_mode) {
+    if (base.targets.size() > 1) {
+      std::fprintf(stderr, "Error: --output cannot be combined with watching a directory\n");
+      return 1;
+    }
+    fs::create_directories(fs::u8path(base.output), ec);
+    if (!fs::is_directory(fs::u8path(base.output), ec)) {
+      std::fprintf(stderr, "Error: Output %s must be a directory when watching a directory\n", base.output.c_str());
+      return 1;
+    }
+  }
+
+  // Start watching before the first pass, so edits made during it are not missed
+  DirectoryWatcher watcher;
+  if (!watcher.open(directory.u8string())) {
+    return 1;
+  }
+
+  auto relevant = [&](const std::string& name) {
+    return directory_mode ? is_image_name(name) : name == file_name;
+  };
+
+  std::map<std::string, SourceState> sources;
+  std::vector<uint8_t> file;
+  auto convert = [&](const std::string& name) {
+    const fs::path path = directory / fs::u8path(name);
+    const std::string path_str = path.u8string();
+
+    if (!read_file(path, file)) {
+      // Deleted, or caught in the middle of an editor's save-by-rename
+      sources.erase(name);
+      debug_log("watch: %s is gone", path_str.c_str());
+      return;
+    }
+
+    // Saves that rewrite identical bytes (or only touch the file) are skipped
+    SourceState& state = sources[name];
+    const uint64_t hash = hash_bytes(file.data(), file.size());
+    if (state.converted && hash == state.hash) {
+      debug_log("watch: %s unchanged", path_str.c_str());
+      return;
+    }
+
+    ConvertJob job = base;
+    job.input = path_str;
+    if (directory_mode) {
+      job.output = (fs::u8path(base.output) / fs::u8path(name).stem()).u8string() + ".icns";
+      job.targets = { output_target(job.output) };
+    }
+    job.watch = false;
+    // Convert straight from the bytes that were just hashed
+    if (convert_data(job, file.data(), file.size(), cache)) {
+      state.hash = hash;
+      state.converted = true;
+      std::printf("Converted %s -> %s\n", path_str.c_str(), job.output.c_str());
+    }
+    else {
+      std::printf("Failed to convert %s; waiting for the next change\n", path_str.c_str());
+    }
+    std::fflush(stdout);
+  };
+
+  auto all_sources = [&](std::set<std::string>& out) {
+    if (!directory_mode) {
+      out.insert(file_name);
+      return;
+    }
+    std::error_code iter_ec;
+    for (const auto& entry : fs::directory_iterator(directory, iter_ec)) {
+      std::string name = entry.path().filename().u8string();
+      if (relevant(name)) out.insert(name);
+    }
+  };
+
+  std::set<std::string> pending;
+  all_sources(pending);
+  for (const std::string& name : pending) {
+    convert(name);
+  }
+  std::printf("Watching %s for changes (Ctrl+C to stop)\n", (directory_mode ? directory : input).u8string().c_str());
+  std::fflush(stdout);
+
+  while (true) {
+    pending.clear();
+    std::vector<std::string> changed;
+    if (!watcher.wait(-1, changed)) {
+      return 1;
+    }
+    // Debounce: keep collecting until the directory has been quiet for a while,
+    // so a save that arrives as several writes triggers one conversion
+    while (!changed.empty()) {
+      for (const std::string& name : changed) {
+        if (name.empty()) {
+          all_sources(pending);
+        }
+        else if (relevant(name)) {
+          pending.insert(name);
+        }
+      }
+      changed.clear();
+      if (!watcher.wait(static_cast<int>(base.debounce_ms), changed)) {
+        return 1;
+      }
+    }
+
+    for (const std::string& name : pending) {
+      convert(name);
+    }
+  }
+}
@@ -0,0 +1,128 @@
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include "zstream.h"
+#include "utils.h"
+
+// Idle streams kept per kind; enough for one per worker on typical machines
+static const size_t kMaxPooled = 16;
+
+struct PooledDeflate {
+  DeflateSettings settings;
+  z_stream* stream;
+};
+
+// Frees the idle streams at exit
+struct StreamPools {
+  std::vector<PooledDeflate> deflates;
+  std::vector<z_stream*> inflates;
+
+  ~StreamPools() {
+    for (auto& d : deflates) {
+      deflateEnd(d.stream);
+      delete d.stream;
+    }
+    for (z_stream* strm : inflates) {
+      inflateEnd(strm);
+      delete strm;
+    }
+  }
+};
+
+static std::mutex pool_mutex;
+static StreamPools pools;
+static std::vector<PooledDeflate>& deflate_pool = pools.deflates;
+static std::vector<z_stream*>& inflate_pool = pools.inflates;
+
+DeflateStream::DeflateStream(const DeflateSettings& settings) : settings_(settings), stream_(nullptr) {
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    for (size_t i = deflate_pool.size(); i-- > 0; ) {
+      if (deflate_pool[i].settings == settings) {
+        stream_ = deflate_pool[i].stream;
+        deflate_pool.erase(deflate_pool.begin() + i);
+        return;
+      }
+    }
+  }
+
+  z_stream* strm = new z_stream{};
+  int ret = deflateInit2(strm, settings.level, Z_DEFLATED, settings.window_bits, settings.mem_level, settings.strategy);
+  if (ret != Z_OK) {
+    std::cerr << "DeflateStream: deflateInit2 failed with code " << ret << "\n";
+    delete strm;
+    return;
+  }
+  debug_log("DeflateStream: initialised new stream (level %d)", settings.level);
+  stream_ = strm;
+}
+
+DeflateStream::~DeflateStream() {
+  if (!stream_) {
+    return;
+  }
+  if (deflateReset(stream_) == Z_OK) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (deflate_pool.size() < kMaxPooled) {
+      deflate_pool.push_back({ settings_, stream_ });
+      return;
+    }
+  }
+  deflateEnd(stream_);
+  delete stream_;
+}
+
+bool DeflateStream::compress(const uint8_t* src, size_t src_len, uint8_t* dst, size_t& dst_len) {
+  if (!stream_) {
+    return false;
+  }
+  stream_->next_in = const_cast<uint8_t*>(src);
+  stream_->avail_in = static_cast<uInt>(src_len);
+  stream_->next_out = dst;
+  stream_->avail_out = static_cast<uInt>(dst_len);
+  int ret = deflate(stream_, Z_FINISH);
+  dst_len = stream_->total_out;
+
+  // Leave the stream ready for another compress() on the same lease
+  deflateReset(stream_);
+  if (ret != Z_STREAM_END) {
+    std::cerr << "DeflateStream: deflate failed with code " << ret << "\n";
+    return false;
+  }
+  return true;
+}
+
+InflateStream::InflateStream() : stream_(nullptr) {
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (!inflate_pool.empty()) {
+      stream_ = inflate_pool.back();
+      inflate_pool.pop_back();
+      return;
+    }
+  }
+
+  z_stream* strm = new z_stream{};
+  int ret = inflateInit(strm);
+  if (ret != Z_OK) {
+    std::cerr << "InflateStream: inflateInit failed with code " << ret << "\n";
+    delete strm;
+    return;
+  }
+  stream_ = strm;
+}
+
+InflateStream::~InflateStream() {
+  if (!stream_) {
+    return;
+  }
+  if (inflateReset(stream_) == Z_OK) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (inflate_pool.size() < kMaxPooled) {
+      inflate_pool.push_back(stream_);
+      return;
+    }
+  }
+  inflateEnd(stream_);
+  delete stream_;
+}